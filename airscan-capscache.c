@@ -0,0 +1,90 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Persistent cache of device capabilities
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Get cache directory. Returned string must be released
+ * with g_free()
+ */
+static char*
+capscache_dir (void)
+{
+    if (conf.cache_dir != NULL) {
+        return g_strdup(conf.cache_dir);
+    }
+
+    return g_build_filename(g_get_user_cache_dir(), "sane-airscan", NULL);
+}
+
+/* Make path of the cache file. Key may contain arbitrary characters
+ * (i.e., it may be URI), so file name is made of its hash
+ */
+static char*
+capscache_path (const char *dir, const char *key)
+{
+    char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+    char *name = g_strconcat("caps-", hash, ".xml", NULL);
+    char *path = g_build_filename(dir, name, NULL);
+
+    g_free(hash);
+    g_free(name);
+
+    return path;
+}
+
+/* Load ScannerCapabilities of the device from the cache
+ */
+char*
+capscache_load (const char *key, size_t *size)
+{
+    char   *dir = capscache_dir();
+    char   *path = capscache_path(dir, key);
+    char   *data = NULL;
+    gsize  len;
+    GError *gerr = NULL;
+
+    if (g_file_get_contents(path, &data, &len, &gerr)) {
+        *size = len;
+    } else {
+        data = NULL;
+        g_error_free(gerr);
+    }
+
+    g_free(path);
+    g_free(dir);
+
+    return data;
+}
+
+/* Save ScannerCapabilities of the device into the cache. File is
+ * replaced atomically, so concurrently running processes never see
+ * partially written data
+ */
+void
+capscache_save (const char *key, const char *data, size_t size)
+{
+    char   *dir = capscache_dir();
+    char   *path = capscache_path(dir, key);
+    GError *gerr = NULL;
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        log_debug(NULL, "caps cache: %s: %s", dir, g_strerror(errno));
+    } else if (!g_file_set_contents(path, data, size, &gerr)) {
+        log_debug(NULL, "caps cache: %s", gerr->message);
+        g_error_free(gerr);
+    }
+
+    g_free(path);
+    g_free(dir);
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -665,7 +665,7 @@ conf_expand_path (const char *path)
 
     end = path[0] ? path : prefix;
     suffix = g_str_has_suffix(end, "/") ? "" : "/";
-    path = g_strconcat(home, path, suffix, NULL);
+    path = g_strconcat(prefix, path, suffix, NULL);
 
     return path;
 }
@@ -721,6 +721,96 @@ conf_load_from_ini (inifile *ini)
                     } else {
                         conf_perror(rec, "usage: model = network | hardware");
                     }
+                } else if (inifile_match_name(rec->variable, "format")) {
+                    if (inifile_match_name(rec->value, "jpeg")) {
+                        conf.prefer_png = false;
+                    } else if (inifile_match_name(rec->value, "png")) {
+                        conf.prefer_png = true;
+                    } else {
+                        conf_perror(rec, "usage: format = jpeg | png");
+                    }
+                } else if (inifile_match_name(rec->variable, "decode_ahead")) {
+                    char          *end;
+                    unsigned long mb = strtoul(rec->value, &end, 10);
+
+                    if (end == rec->value || *end != '\0') {
+                        conf_perror(rec, "usage: decode_ahead = megabytes");
+                    } else {
+                        conf.decode_ahead = (size_t) mb * 1024 * 1024;
+                    }
+                } else if (inifile_match_name(rec->variable, "spool_memory")) {
+                    char          *end;
+                    unsigned long mb = strtoul(rec->value, &end, 10);
+
+                    if (end == rec->value || *end != '\0') {
+                        conf_perror(rec, "usage: spool_memory = megabytes");
+                    } else {
+                        conf.spool_memory = (size_t) mb * 1024 * 1024;
+                    }
+                } else if (inifile_match_name(rec->variable, "adf_prefetch")) {
+                    char          *end;
+                    unsigned long n = strtoul(rec->value, &end, 10);
+
+                    if (end == rec->value || *end != '\0' ||
+                        n < 1 || n > CONFIG_ADF_PREFETCH_MAX) {
+                        conf_perror(rec, "usage: adf_prefetch = 1...8");
+                    } else {
+                        conf.adf_prefetch = (int) n;
+                    }
+                } else if (inifile_match_name(rec->variable, "http_client")) {
+                    if (inifile_match_name(rec->value, "libsoup")) {
+                        conf.http_native = false;
+                    } else if (inifile_match_name(rec->value, "native")) {
+                        conf.http_native = true;
+                    } else {
+                        conf_perror(rec, "usage: http_client = libsoup | native");
+                    }
+                } else if (inifile_match_name(rec->variable, "caps_cache")) {
+                    if (inifile_match_name(rec->value, "enable")) {
+                        conf.caps_cache = true;
+                    } else if (inifile_match_name(rec->value, "disable")) {
+                        conf.caps_cache = false;
+                    } else {
+                        conf_perror(rec, "usage: caps_cache = enable | disable");
+                    }
+                } else if (inifile_match_name(rec->variable, "caps_fetch")) {
+                    if (inifile_match_name(rec->value, "discovery")) {
+                        conf.caps_lazy = false;
+                    } else if (inifile_match_name(rec->value, "open")) {
+                        conf.caps_lazy = true;
+                    } else {
+                        conf_perror(rec, "usage: caps_fetch = discovery | open");
+                    }
+                } else if (inifile_match_name(rec->variable, "list_timeout")) {
+                    char          *end;
+                    unsigned long ms = strtoul(rec->value, &end, 10);
+
+                    if (end == rec->value || *end != '\0' || ms > G_MAXINT) {
+                        conf_perror(rec, "usage: list_timeout = milliseconds");
+                    } else {
+                        conf.list_timeout = (int) ms;
+                    }
+                } else if (inifile_match_name(rec->variable, "device_timeout")) {
+                    char          *end;
+                    unsigned long ms = strtoul(rec->value, &end, 10);
+
+                    if (end == rec->value || *end != '\0' || ms > G_MAXINT) {
+                        conf_perror(rec, "usage: device_timeout = milliseconds");
+                    } else {
+                        conf.device_timeout = (int) ms;
+                    }
+                } else if (inifile_match_name(rec->variable, "cache_dir")) {
+                    g_free((char*) conf.cache_dir);
+                    conf.cache_dir = conf_expand_path(rec->value);
+                    if (conf.cache_dir == NULL) {
+                        conf_perror(rec, "failed to expand path");
+                    }
+                } else if (inifile_match_name(rec->variable, "spool_dir")) {
+                    g_free((char*) conf.spool_dir);
+                    conf.spool_dir = conf_expand_path(rec->value);
+                    if (conf.spool_dir == NULL) {
+                        conf_perror(rec, "failed to expand path");
+                    }
                 }
             } else if (inifile_match_name(rec->section, "debug")) {
                 if (inifile_match_name(rec->variable, "trace")) {
@@ -886,6 +976,8 @@ conf_unload (void)
 {
     conf_device_list_free();
     g_free((char*) conf.dbg_trace);
+    g_free((char*) conf.spool_dir);
+    g_free((char*) conf.cache_dir);
     memset(&conf, 0, sizeof(conf));
 }
 
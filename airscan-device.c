@@ -8,22 +8,42 @@
 
 #include "airscan.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /******************** Constants *********************/
-/* Max time to wait until device table is ready, in seconds
+/* Device addresses are probed concurrently. Probes are started
+ * with this delay between them, in milliseconds, unless previous
+ * probe fails earlier
  */
-#define DEVICE_TABLE_READY_TIMEOUT              5
+#define DEVICE_PROBE_STAGGER                    250
 
-/* If HTTP 503 reply is received, how many retry attempts
- * to perform before giving up
+/* If HTTP 503 reply is received, how long to retry
+ * before giving up, in seconds
  */
-#define DEVICE_HTTP_RETRY_ATTEMPTS              10
+#define DEVICE_HTTP_RETRY_TIMEOUT               10
 
-/* And pause between retries, in seconds
+/* Pause between retries, in milliseconds. It starts from the
+ * minimum and grows exponentially up to the maximum. Actual pause
+ * is randomly varied by DEVICE_HTTP_RETRY_JITTER percents
  */
-#define DEVICE_HTTP_RETRY_PAUSE                 1
+#define DEVICE_HTTP_RETRY_PAUSE_MIN             50
+#define DEVICE_HTTP_RETRY_PAUSE_MAX             1000
+#define DEVICE_HTTP_RETRY_JITTER                25
+
+/* While scanner reports it is processing the job, retry without
+ * rechecking ScannerStatus, if it was checked within this
+ * interval, in milliseconds
+ */
+#define DEVICE_HTTP_STATUS_INTERVAL             1000
+
+/* Size of the ring buffer of decoded lines, in bytes. Ring
+ * contains at least two lines, regardless of this limit
+ */
+#define DEVICE_READ_RING_SIZE                   (1024 * 1024)
 
 /******************** Device management ********************/
 /* Device flags
@@ -38,10 +58,21 @@ enum {
     DEVICE_SCANNING         = (1 << 5), /* We are between sane_start() and
                                            final sane_read() */
     DEVICE_CLOSING          = (1 << 6), /* Close in progress */
+    DEVICE_LAZY             = (1 << 7), /* Device listed, but probing is
+                                           deferred until open */
+    DEVICE_PROBING          = (1 << 8), /* Lazily listed device is being
+                                           probed on open */
 
     DEVICE_ALL_FLAGS        = 0xffffffff
 };
 
+/* Listed devices with these flags are indexed, so they can be
+ * enumerated without scanning the whole device_table. These flags
+ * must be only changed with device_flags_update()
+ */
+#define DEVICE_INDEXED_FLAGS    \
+        (DEVICE_LISTED | DEVICE_READY | DEVICE_INIT_WAIT | DEVICE_LAZY)
+
 /* Device states
  */
 typedef enum {
@@ -57,6 +88,42 @@ typedef enum {
 
 } DEVICE_STATE;
 
+/* Page of the scan job
+ */
+typedef struct device_page device_page;
+
+/* Pending probe of device address
+ */
+typedef struct {
+    zeroconf_addrinfo *addrinfo;  /* Address being probed */
+    http_query        *q;         /* ScannerCapabilities query */
+    gint64            start;      /* When probe was started */
+} device_probe;
+
+/* Device address that has responded to probe
+ */
+typedef struct {
+    zeroconf_addrinfo *addrinfo;  /* The address */
+    gint64            rtt;        /* Probe round trip time, usec */
+} device_addr;
+
+/* Pending HTTP GET ${dev->job_location}/NextDocument request.
+ *
+ * During ADF scan, next page may be requested as soon as response
+ * headers of the previous request are received, so several such
+ * requests may be pending. They are kept in dev->job_loaders in
+ * the order of issuing, which is also the order of pages. Only
+ * the first one is received incrementally; others are completed
+ * in background and processed, when their turn comes
+ */
+typedef struct {
+    http_query  *q;      /* Pending query, NULL if finished */
+    bool        hdr_ok;  /* HTTP 200 response headers received */
+    bool        ok;      /* Finished successfully */
+    int         status;  /* HTTP status of finished query */
+    http_data   *data;   /* Response data of finished query */
+} device_loader;
+
 /* Device descriptor
  */
 struct device {
@@ -73,20 +140,46 @@ struct device {
     /* I/O handling (AVAHI and HTTP) */
     zeroconf_addrinfo    *addresses;    /* Device addresses, NULL if
                                            device was statically added */
-    zeroconf_addrinfo    *addr_current; /* Current address to probe */
+    zeroconf_addrinfo    *addr_current; /* Address in use */
+    zeroconf_addrinfo    *addr_next;    /* Next address to probe */
+    GPtrArray            *addr_rank;    /* Responded addresses, fastest
+                                           first, array of device_addr* */
+    int                  addr_failover; /* Failovers within current job */
+    gint64               add_time;      /* When device was added */
+    GPtrArray            *probes;       /* Array of device_probe* */
+    char                 *caps_key;     /* Capabilities cache key */
+    char                 *caps_hash;    /* Hash of cached capabilities,
+                                           NULL if not loaded from cache
+                                           or already revalidated */
+    eloop_timer          *probe_timer;  /* Starts next probe */
     http_uri             *uri_escl;     /* eSCL base URI */
     http_client          *http_client;  /* HTTP client */
+    http_client          *http_background; /* HTTP client for background
+                                              requests, without onerror
+                                              callback */
     eloop_timer          *http_timer;   /* HTTP retry timer */
     int                  http_retry;    /* HTTP retry count */
+    gint64               http_retry_start;  /* When retrying started */
+    gint64               http_status_time;  /* When ScannerStatus was
+                                               checked last time */
+    bool                 http_status_busy;  /* And it was Processing */
+    gint64               page_latency;      /* Learned first page latency,
+                                               usec, 0 if unknown */
     trace                *trace;        /* Protocol trace */
 
     /* Scanning state machinery */
     SANE_Status          job_status;          /* Job completion status */
+    gint64               job_start_time;      /* When job was created */
     GString              *job_location;       /* Scanned page location */
     bool                 job_has_location;    /* Location is valid */
     eloop_event          *job_cancel_event;   /* Cancel event */
     bool                 job_cancel_rq;       /* Cancel requested */
-    GPtrArray            *job_images;         /* Array of SoupBuffer* */
+    bool                 job_png;             /* Job uses PNG format */
+    int                  job_scale;           /* Image downscaling factor */
+    GPtrArray            *job_images;         /* Array of device_page* */
+    GPtrArray            *job_loaders;        /* Array of device_loader* */
+    device_page          *job_image_loading;  /* Page being received now */
+    size_t               job_images_mem;      /* Memory used by queued pages */
     unsigned int         job_images_received; /* How many images received */
     SANE_Word            job_skip_x;          /* How much pixels to skip, */
     SANE_Word            job_skip_y;          /*    from left and top */
@@ -94,40 +187,92 @@ struct device {
     /* Read machinery */
     SANE_Bool            read_non_blocking;  /* Non-blocking I/O mode */
     image_decoder        *read_decoder_jpeg; /* JPEG decoder */
+    image_decoder        *read_decoder_png;  /* PNG decoder */
+    image_decoder        *read_decoder_pnm;  /* Decoder for decoded-ahead
+                                                pages */
+    image_decoder        *read_decoder;      /* Decoder of current page */
     pollable             *read_pollable;     /* Signalled when read won't
                                                 block */
-    http_data            *read_image;        /* Current image */
-    SANE_Byte            *read_line_buf;     /* Single-line buffer */
+    device_page          *read_page;         /* Current page */
+    bool                 read_started;       /* Image decoding started */
+    GRecMutex            read_lock;          /* Protects decoder and data
+                                                of the page being received,
+                                                shared with the worker */
+    bool                 read_loading;       /* More page data expected,
+                                                under read_lock */
+    GThread              *read_worker;       /* Background decoder thread */
+    pollable             *read_worker_wakeup;/* Wakes up the worker */
+    volatile gint        read_worker_stop;   /* Worker stop requested */
+    volatile gint        read_worker_done;   /* Worker has finished */
+    SANE_Status          read_worker_status; /* Worker completion status */
+    SANE_Byte            *read_ring_buf;     /* Ring of decoded lines */
+    size_t               read_ring_stride;   /* Distance between lines */
+    SANE_Int             read_ring_cap;      /* Ring capacity, in lines */
+    volatile gint        read_ring_head;     /* Lines consumed by reader */
+    volatile gint        read_ring_tail;     /* Lines produced by worker */
+    SANE_Int             read_line_off;      /* Offset in the head line */
+
+    /* Owned by the worker, while it runs */
     SANE_Int             read_line_num;      /* Current image line 0-based */
     SANE_Int             read_line_end;      /* If read_line_num>read_line_end
                                                 no more lines left in image */
-    SANE_Int             read_line_off;      /* Current offset in the line */
-    SANE_Int             read_skip_lines;    /* How many lines to skip */
+    SANE_Int             read_skip_lines;    /* How many lines to skip, if
+                                                not skipped by decoder */
     SANE_Int             read_skip_bytes;    /* How many bytes to skip at line
                                                 beginning */
+    SANE_Int             read_line_width;    /* Line width before conversion,
+                                                in bytes */
+    SANE_Int             read_line_decoded;  /* Bytes per line, written by
+                                                decoder */
+    bool                 read_lineart;       /* Convert lines to lineart */
 };
 
 /* Static variables
  */
 static GPtrArray *device_table;
+static GHashTable *device_table_index;
 static GCond device_table_cond;
+static GThreadPool *device_decode_ahead_pool;
+static GThreadPool *device_spool_pool;
+static size_t device_decode_ahead_used;
+G_LOCK_DEFINE_STATIC(device_decode_ahead);
+
+/* Devices with indexed flags, by flag
+ */
+static struct {
+    unsigned int flag;      /* Device flag */
+    GPtrArray    *devices;  /* Listed devices with this flag */
+} device_table_buckets[] = {
+    {DEVICE_READY,     NULL},
+    {DEVICE_INIT_WAIT, NULL},
+    {DEVICE_LAZY,      NULL}
+};
 
 /* Forward declarations
  */
 static device*
 device_find (const char *name);
 
+static void
+device_flags_update (device *dev, unsigned int set, unsigned int clear);
+
 static void
 device_http_cancel (device *dev);
 
 static void
-device_http_onerror (device *dev, error err);
+device_http_onerror (device *dev, http_query *q, error err);
 
 static void
 device_scanner_capabilities_callback (device *dev, http_query *q);
 
 static void
-device_probe_address (device *dev, zeroconf_addrinfo *addrinfo);
+device_probe_start (device *dev);
+
+static void
+device_probe_cancel (device *dev);
+
+static void
+device_caps_load (device *dev);
 
 static void
 device_job_set_status (device *dev, SANE_Status status);
@@ -138,21 +283,347 @@ device_job_abort (device *dev, SANE_Status status);
 static void
 device_escl_cleanup (device *dev);
 
-static void
+static bool
 device_escl_load_retry (device *dev);
 
 static void
 device_escl_load_page (device *dev);
 
+static void
+device_escl_load_page_drop (device *dev);
+
+static int
+device_escl_load_page_find (device *dev, http_query *q);
+
+static void
+device_escl_load_page_purge (device *dev);
+
+static bool
+device_escl_failover (device *dev);
+
+static bool
+device_read_queue_forget (device *dev, device_page *page);
+
 static void
 device_read_queue_purge (device *dev);
 
 static bool
 device_read_push (device *dev);
 
+static bool
+device_read_update (device *dev, device_page *page, bool more);
+
+static void
+device_read_finish (device *dev);
+
+static gpointer
+device_read_worker (gpointer data);
+
 static void
 device_management_start_stop (bool start);
 
+/******************** Scan job pages ********************/
+/* Decode-ahead states of the page
+ */
+enum {
+    DEVICE_PAGE_COMPRESSED,     /* Page is not decoded ahead */
+    DEVICE_PAGE_QUEUED,         /* Page is queued for decoding */
+    DEVICE_PAGE_DECODING,       /* Page decoding is in progress */
+    DEVICE_PAGE_DECODED,        /* Page is decoded */
+    DEVICE_PAGE_CLAIMED         /* Page is removed from the job queue */
+};
+
+/* Page of the scan job. Pages are reference-counted, because
+ * page may be shared between device and decode-ahead or spool worker
+ */
+struct device_page {
+    volatile gint refcnt;       /* Reference counter */
+    volatile gint state;        /* Decode-ahead state */
+    http_data     *data;        /* Image, as received from device */
+    bool          png;          /* Image is PNG, otherwise JPEG */
+    int           scale;        /* Image downscaling factor */
+    void          *raw;         /* Decoded image, in PNM format */
+    size_t        raw_size;     /* Size of decoded image */
+    bool          accounted;    /* Counted in dev->job_images_mem */
+    int           spool_fd;     /* Spool file, -1 if page is in memory */
+    size_t        spool_size;   /* Size of spooled image */
+    void          *spool_map;   /* Spool file mapping, NULL if not mapped */
+};
+
+/* Create new page
+ */
+static device_page*
+device_page_new (device *dev, http_data *data)
+{
+    device_page *page = g_new0(device_page, 1);
+
+    page->refcnt = 1;
+    page->state = DEVICE_PAGE_COMPRESSED;
+    page->data = http_data_ref(data);
+    page->png = dev->job_png;
+    page->scale = dev->job_scale;
+    page->spool_fd = -1;
+
+    return page;
+}
+
+/* Ref the page
+ */
+static device_page*
+device_page_ref (device_page *page)
+{
+    g_atomic_int_inc(&page->refcnt);
+    return page;
+}
+
+/* Release memory, consumed by decoded image
+ */
+static void
+device_page_free_raw (device_page *page)
+{
+    if (page->raw != NULL) {
+        G_LOCK(device_decode_ahead);
+        device_decode_ahead_used -= page->raw_size;
+        G_UNLOCK(device_decode_ahead);
+
+        g_free(page->raw);
+        page->raw = NULL;
+        page->raw_size = 0;
+    }
+}
+
+/* Unref the page
+ */
+static void
+device_page_unref (device_page *page)
+{
+    if (page != NULL && g_atomic_int_dec_and_test(&page->refcnt)) {
+        device_page_free_raw(page);
+        http_data_unref(page->data);
+
+        if (page->spool_map != NULL) {
+            munmap(page->spool_map, page->spool_size);
+        }
+
+        if (page->spool_fd >= 0) {
+            close(page->spool_fd);
+        }
+
+        g_free(page);
+    }
+}
+
+/* Write the page image into the spool file. Spool file is
+ * unlinked immediately after creation, so it will be removed
+ * automatically when closed, or if process terminates
+ *
+ * Called by the spool worker, so page is not modified here.
+ * Returns spool file descriptor or -1 on error. Error message
+ * is returned via err_out and must be released with g_free()
+ */
+static int
+device_page_spool_write (device_page *page, char **err_out)
+{
+    const char    *dir = conf.spool_dir ? conf.spool_dir : g_get_tmp_dir();
+    char          *path = g_build_filename(dir, "airscan-XXXXXX", NULL);
+    const uint8_t *bytes = page->data->bytes;
+    size_t        size = page->data->size, off = 0;
+    int           fd;
+
+    fd = g_mkstemp(path);
+    if (fd < 0) {
+        *err_out = g_strdup_printf("spool: %s: %s", path, g_strerror(errno));
+        goto DONE;
+    }
+
+    unlink(path);
+
+    while (off < size) {
+        ssize_t rc = write(fd, bytes + off, size - off);
+        if (rc < 0 && errno != EINTR) {
+            *err_out = g_strdup_printf("spool: write: %s", g_strerror(errno));
+            close(fd);
+            fd = -1;
+            goto DONE;
+        }
+
+        if (rc > 0) {
+            off += rc;
+        }
+    }
+
+DONE:
+    g_free(path);
+    return fd;
+}
+
+/* Map spooled page into memory
+ */
+static error
+device_page_map (device_page *page)
+{
+    void *p;
+
+    if (page->spool_map != NULL) {
+        return NULL;
+    }
+
+    p = mmap(NULL, page->spool_size, PROT_READ, MAP_PRIVATE,
+            page->spool_fd, 0);
+    if (p == MAP_FAILED) {
+        return eloop_eprintf("spool: mmap: %s", g_strerror(errno));
+    }
+
+    page->spool_map = p;
+
+    return NULL;
+}
+
+/* Get page image bytes. Spooled page must be mapped
+ */
+static const void*
+device_page_bytes (device_page *page, size_t *size)
+{
+    if (page->data == NULL) {
+        *size = page->spool_size;
+        return page->spool_map;
+    }
+
+    *size = page->data->size;
+    return page->data->bytes;
+}
+
+/* Claim the page, when it is removed from the job queue. Returns
+ * true, if page was decoded ahead, and its decoded image can be used
+ *
+ * If decoding is still in progress, it will be discarded
+ */
+static bool
+device_page_claim (device_page *page)
+{
+    gint state;
+
+    do {
+        state = g_atomic_int_get(&page->state);
+    } while (!g_atomic_int_compare_and_exchange(&page->state,
+            state, DEVICE_PAGE_CLAIMED));
+
+    return state == DEVICE_PAGE_DECODED;
+}
+
+/* Reserve memory for decoded image within the decode-ahead budget
+ */
+static bool
+device_decode_ahead_reserve (size_t size)
+{
+    bool ok = false;
+
+    G_LOCK(device_decode_ahead);
+    if (device_decode_ahead_used + size <= conf.decode_ahead) {
+        device_decode_ahead_used += size;
+        ok = true;
+    }
+    G_UNLOCK(device_decode_ahead);
+
+    return ok;
+}
+
+/* Decode the page into raw PNM image. Returns false, if page
+ * cannot be decoded or doesn't fit the memory budget
+ */
+static bool
+device_decode_ahead_decode (device_page *page)
+{
+    image_decoder   *decoder = page->png ?
+            image_decoder_png_new() : image_decoder_jpeg_new();
+    SANE_Parameters params;
+    char            header[64];
+    size_t          hdr_len, size;
+    uint8_t         *raw = NULL;
+    int             line = 0, got;
+    error           err;
+
+    image_decoder_set_scale(decoder, page->scale);
+    err = image_decoder_begin(decoder, page->data->bytes,
+            page->data->size, false);
+    if (err != NULL) {
+        goto DONE;
+    }
+
+    image_decoder_get_params(decoder, &params);
+    hdr_len = snprintf(header, sizeof(header), "P%c\n%d %d\n255\n",
+            params.format == SANE_FRAME_GRAY ? '5' : '6',
+            params.pixels_per_line, params.lines);
+
+    size = hdr_len + (size_t) params.bytes_per_line * params.lines;
+    if (!device_decode_ahead_reserve(size)) {
+        goto DONE;
+    }
+
+    raw = g_malloc(size);
+    memcpy(raw, header, hdr_len);
+
+    while (err == NULL && line < params.lines) {
+        err = image_decoder_read_lines(decoder,
+                raw + hdr_len + (size_t) line * params.bytes_per_line,
+                params.bytes_per_line, params.lines - line, &got);
+        line += got;
+    }
+
+    /* Publish decoded image. Note, page->raw must be set
+     * before the page state is changed
+     */
+    page->raw = raw;
+    page->raw_size = size;
+
+    if (err != NULL ||
+        !g_atomic_int_compare_and_exchange(&page->state,
+            DEVICE_PAGE_DECODING, DEVICE_PAGE_DECODED)) {
+        device_page_free_raw(page);
+        raw = NULL;
+    }
+
+DONE:
+    image_decoder_free(decoder);
+    return raw != NULL;
+}
+
+/* Decode-ahead worker pool task
+ */
+static void
+device_decode_ahead_task (gpointer data, gpointer user_data)
+{
+    device_page *page = data;
+
+    (void) user_data;
+
+    if (g_atomic_int_compare_and_exchange(&page->state,
+            DEVICE_PAGE_QUEUED, DEVICE_PAGE_DECODING)) {
+        if (!device_decode_ahead_decode(page)) {
+            g_atomic_int_compare_and_exchange(&page->state,
+                DEVICE_PAGE_DECODING, DEVICE_PAGE_COMPRESSED);
+        }
+    }
+
+    device_page_unref(page);
+}
+
+/* Schedule decode-ahead of the page, if enabled
+ */
+static void
+device_decode_ahead_schedule (device_page *page)
+{
+    if (device_decode_ahead_pool == NULL) {
+        return;
+    }
+
+    if (g_atomic_int_compare_and_exchange(&page->state,
+            DEVICE_PAGE_COMPRESSED, DEVICE_PAGE_QUEUED)) {
+        g_thread_pool_push(device_decode_ahead_pool,
+                device_page_ref(page), NULL);
+    }
+}
+
 /******************** Device table management ********************/
 /* Add device to the table
  */
@@ -178,30 +649,52 @@ device_add (const char *name, zeroconf_addrinfo *addresses,
 
     dev->refcnt = 1;
     dev->name = g_strdup(name);
-    dev->flags = DEVICE_LISTED | DEVICE_INIT_WAIT;
-    if (init_scan) {
-        dev->flags |= DEVICE_INIT_WAIT;
-    }
+    dev->add_time = g_get_monotonic_time();
     devopt_init(&dev->opt);
 
     dev->http_client = http_client_new(dev);
+    dev->http_background = http_client_new(dev);
     dev->trace = trace_open(name);
 
     dev->job_location = g_string_new(NULL);
     g_cond_init(&dev->state_cond);
     dev->job_images = g_ptr_array_new();
+    dev->job_loaders = g_ptr_array_new();
+    dev->probes = g_ptr_array_new();
+    dev->addr_rank = g_ptr_array_new_with_free_func(g_free);
 
     dev->read_decoder_jpeg = image_decoder_jpeg_new();
+    dev->read_decoder_png = image_decoder_png_new();
+    dev->read_decoder_pnm = image_decoder_pnm_new();
     dev->read_pollable = pollable_new();
+    dev->read_worker_wakeup = pollable_new();
+    g_rec_mutex_init(&dev->read_lock);
 
     log_debug(dev, "device created");
 
     /* Add to the table */
     g_ptr_array_add(device_table, dev);
+    g_hash_table_insert(device_table_index, (gpointer) dev->name, dev);
+    device_flags_update(dev, DEVICE_LISTED | DEVICE_INIT_WAIT, 0);
+    if (init_scan) {
+        device_flags_update(dev, DEVICE_INIT_WAIT, 0);
+    }
 
     /* Initialize device I/O */
     dev->addresses = zeroconf_addrinfo_list_copy(addresses);
-    device_probe_address(dev, dev->addresses);
+    dev->addr_next = dev->addresses;
+    device_caps_load(dev);
+
+    /* In lazy mode, device loaded from the cache is ready
+     * and used as is, without probing
+     */
+    if (conf.caps_lazy) {
+        if ((dev->flags & DEVICE_READY) == 0) {
+            device_flags_update(dev, DEVICE_LAZY, DEVICE_INIT_WAIT);
+        }
+    } else {
+        device_probe_start(dev);
+    }
 
     return;
 }
@@ -229,6 +722,8 @@ device_unref (device *dev)
 
         /* Release all memory */
         g_free((void*) dev->name);
+        g_free(dev->caps_key);
+        g_free(dev->caps_hash);
 
         devopt_cleanup(&dev->opt);
 
@@ -236,14 +731,22 @@ device_unref (device *dev)
 
         http_uri_free(dev->uri_escl);
         http_client_free(dev->http_client);
+        http_client_free(dev->http_background);
 
         g_string_free(dev->job_location, TRUE);
         g_cond_clear(&dev->state_cond);
         device_read_queue_purge(dev);
         g_ptr_array_free(dev->job_images, TRUE);
+        g_ptr_array_free(dev->job_loaders, TRUE);
+        g_ptr_array_free(dev->probes, TRUE);
+        g_ptr_array_free(dev->addr_rank, TRUE);
 
         image_decoder_free(dev->read_decoder_jpeg);
+        image_decoder_free(dev->read_decoder_png);
+        image_decoder_free(dev->read_decoder_pnm);
         pollable_free(dev->read_pollable);
+        pollable_free(dev->read_worker_wakeup);
+        g_rec_mutex_clear(&dev->read_lock);
 
         g_free(dev);
     }
@@ -263,16 +766,19 @@ device_del (device *dev)
     log_debug(dev, "removed from device table");
     log_assert(dev, (dev->flags & DEVICE_LISTED) != 0);
 
-    dev->flags &= ~DEVICE_LISTED;
-    g_ptr_array_remove(device_table, dev);
+    device_flags_update(dev, 0, DEVICE_LISTED);
+    g_ptr_array_remove_fast(device_table, dev);
+    g_hash_table_remove(device_table_index, dev->name);
 
     /* Stop all pending I/O activity */
+    device_probe_cancel(dev);
     device_http_cancel(dev);
+    http_client_cancel(dev->http_background);
     trace_close(dev->trace);
     dev->trace = NULL;
 
     dev->flags |= DEVICE_HALTED;
-    dev->flags &= ~DEVICE_READY;
+    device_flags_update(dev, 0, DEVICE_READY);
 
     /* Unref the device */
     device_unref(dev);
@@ -283,16 +789,29 @@ device_del (device *dev)
 static device*
 device_find (const char *name)
 {
-    unsigned int i;
+    return g_hash_table_lookup(device_table_index, name);
+}
+
+/* Set and clear device flags, updating index
+ */
+static void
+device_flags_update (device *dev, unsigned int set, unsigned int clear)
+{
+    unsigned int old = dev->flags, i;
+
+    dev->flags = (old | set) & ~clear;
 
-    for (i = 0; i < device_table->len; i ++) {
-        device *dev = g_ptr_array_index(device_table, i);
-        if (!strcmp(dev->name, name)) {
-            return dev;
+    for (i = 0; i < G_N_ELEMENTS(device_table_buckets); i ++) {
+        unsigned int mask = DEVICE_LISTED | device_table_buckets[i].flag;
+        bool         was = (old & mask) == mask;
+        bool         now = (dev->flags & mask) == mask;
+
+        if (was && !now) {
+            g_ptr_array_remove_fast(device_table_buckets[i].devices, dev);
+        } else if (now && !was) {
+            g_ptr_array_add(device_table_buckets[i].devices, dev);
         }
     }
-
-    return NULL;
 }
 
 /* Collect devices matching the flags. Return count of
@@ -309,6 +828,36 @@ device_table_collect (unsigned int flags, device *out[])
 {
     unsigned int x, y = 0;
 
+    /* Use index, if possible. Device may be in several buckets,
+     * so devices with flags of already visited buckets are skipped
+     */
+    if ((flags & ~DEVICE_INDEXED_FLAGS) == 0 &&
+        (flags & DEVICE_LISTED) == 0) {
+        unsigned int i, seen = 0;
+
+        for (i = 0; i < G_N_ELEMENTS(device_table_buckets); i ++) {
+            GPtrArray *devices = device_table_buckets[i].devices;
+
+            if ((flags & device_table_buckets[i].flag) == 0) {
+                continue;
+            }
+
+            for (x = 0; x < devices->len; x ++) {
+                device *dev = g_ptr_array_index(devices, x);
+                if ((dev->flags & seen) == 0) {
+                    if (out != NULL) {
+                        out[y] = dev;
+                    }
+                    y ++;
+                }
+            }
+
+            seen |= device_table_buckets[i].flag;
+        }
+
+        return y;
+    }
+
     for (x = 0; x < device_table->len; x ++) {
         device *dev = g_ptr_array_index(device_table, x);
         if ((dev->flags & flags) != 0) {
@@ -345,13 +894,39 @@ device_table_purge (void)
     }
 }
 
+/* Get deadline of the DEVICE_INIT_WAIT device, after which
+ * device_list_sync() doesn't wait for it anymore
+ */
+static inline gint64
+device_init_deadline (device *dev)
+{
+    return dev->add_time + (gint64) conf.device_timeout * 1000;
+}
+
 /* Check if device table is ready, i.e., there is no DEVICE_INIT_WAIT
- * devices
+ * devices within their deadlines. If table is not ready, the nearest
+ * deadline is returned via `wakeup'
  */
 static bool
-device_table_ready (void)
+device_table_ready (gint64 now, gint64 *wakeup)
 {
-    return device_table_collect(DEVICE_INIT_WAIT, NULL) == 0;
+    device       **devices = g_newa(device*, device_table_size());
+    unsigned int count = device_table_collect(DEVICE_INIT_WAIT, devices);
+    unsigned int i;
+    bool         ready = true;
+
+    for (i = 0; i < count; i ++) {
+        gint64 deadline = device_init_deadline(devices[i]);
+
+        if (deadline > now) {
+            if (ready || deadline < *wakeup) {
+                *wakeup = deadline;
+            }
+            ready = false;
+        }
+    }
+
+    return ready;
 }
 
 /******************** Device state management ********************/
@@ -405,22 +980,23 @@ device_state_set (device *dev, DEVICE_STATE state)
  *
  * Content type of the outgoing requests assumed to be "text/xml"
  */
-static void
+static http_query*
 device_http_perform (device *dev, const char *path,
         const char *method, char *body,
         void (*callback)(device*, http_query *q))
 {
     http_uri *uri = http_uri_new_relative(dev->uri_escl, path, true, false);
-    http_query_new(dev->http_client, uri, method, body, "text/xml", callback);
+    return http_query_new(dev->http_client, uri, method, body, "text/xml",
+            callback);
 }
 
 /* Initiate HTTP GET request
  */
-static void
+static http_query*
 device_http_get (device *dev, const char *path,
         void (*callback)(device*, http_query *q))
 {
-    device_http_perform(dev, path, "GET", NULL, callback);
+    return device_http_perform(dev, path, "GET", NULL, callback);
 }
 
 /* Cancel pending HTTP request, if any
@@ -428,7 +1004,9 @@ device_http_get (device *dev, const char *path,
 static void
 device_http_cancel (device *dev)
 {
+    device_escl_load_page_purge(dev);
     http_client_cancel(dev->http_client);
+    device_escl_load_page_drop(dev);
     if (dev->http_timer != NULL) {
         eloop_timer_cancel(dev->http_timer);
         dev->http_timer = NULL;
@@ -438,8 +1016,29 @@ device_http_cancel (device *dev)
 /* http_client onerror callback
  */
 static void
-device_http_onerror (device *dev, error err) {
+device_http_onerror (device *dev, http_query *q, error err) {
+    int idx = device_escl_load_page_find(dev, q);
+
     log_debug(dev, ESTRING(err));
+
+    /* The failed query is released by the caller, so if it is
+     * NextDocument request, detach it from its loader. Otherwise
+     * loader purge below would free it second time
+     */
+    if (idx >= 0) {
+        device_loader *loader = g_ptr_array_index(dev->job_loaders, idx);
+        loader->q = NULL;
+    }
+
+    /* Retry on another address, if possible */
+    if (device_escl_failover(dev)) {
+        return;
+    }
+
+    /* Note, other requests may be pending, i.e., prefetched
+     * ADF pages, but job is finished now
+     */
+    device_http_cancel(dev);
     device_job_set_status(dev, SANE_STATUS_IO_ERROR);
 
     if (dev->job_has_location) {
@@ -449,44 +1048,441 @@ device_http_onerror (device *dev, error err) {
     }
 }
 
-/******************** ESCL initialization ********************/
-/* Probe next device address
+/******************** Device quirks ********************/
+/* Device quirks
+ */
+enum {
+    DEVICE_QUIRK_CONNECTION_CLOSE   = (1 << 0), /* Don't use persistent
+                                                   connections */
+};
+
+/* Table of device quirks. Vendor and model patterns are matched
+ * case-insensitively against device capabilities, `*' and `?'
+ * wildcards are allowed
+ */
+static const struct {
+    const char   *vendor;   /* Vendor pattern */
+    const char   *model;    /* Model pattern */
+    unsigned int quirks;    /* Device quirks */
+} device_quirks_table[] = {
+    /* On Kyocera ECOSYS M2040dn connection keep-alive causes
+     * scanned job to remain in "Processing" state about 10 seconds
+     * after job has been actually completed, making scanner effectively
+     * busy. Looks like Kyocera firmware bug
+     */
+    {"kyocera*", "*ecosys m2040dn*", DEVICE_QUIRK_CONNECTION_CLOSE},
+};
+
+/* Lookup quirks of the device, based on its capabilities
+ */
+static unsigned int
+device_quirks_lookup (device *dev)
+{
+    const char   *caps_model = dev->opt.caps.model ? dev->opt.caps.model : "";
+    char         *vendor = g_ascii_strdown(dev->opt.caps.vendor, -1);
+    char         *model = g_ascii_strdown(caps_model, -1);
+    unsigned int quirks = 0;
+    size_t       i;
+
+    for (i = 0; i < G_N_ELEMENTS(device_quirks_table); i ++) {
+        if (g_pattern_match_simple(device_quirks_table[i].vendor, vendor) &&
+            g_pattern_match_simple(device_quirks_table[i].model, model)) {
+            quirks |= device_quirks_table[i].quirks;
+        }
+    }
+
+    g_free(vendor);
+    g_free(model);
+
+    return quirks;
+}
+
+/* Apply device quirks
  */
 static void
-device_probe_address (device *dev, zeroconf_addrinfo *addrinfo)
+device_quirks_apply (device *dev)
 {
-    /* Cleanup after previous probe */
-    dev->addr_current = addrinfo;
-    if (dev->uri_escl != NULL) {
-        http_uri_free(dev->uri_escl);
+    unsigned int quirks = device_quirks_lookup(dev);
+
+    if ((quirks & DEVICE_QUIRK_CONNECTION_CLOSE) != 0) {
+        log_debug(dev, "quirk: persistent connections disabled");
+        http_client_keepalive(dev->http_client, false);
+        http_client_keepalive(dev->http_background, false);
     }
+}
+
+/******************** ESCL initialization ********************/
+/* Make eSCL base URI for the device address
+ */
+static http_uri*
+device_probe_uri (device *dev, zeroconf_addrinfo *addrinfo)
+{
+    http_uri   *uri = http_uri_new(addrinfo->uri, true);
+    const char *path;
 
-    /* Parse device URI */
-    dev->uri_escl = http_uri_new(addrinfo->uri, true);
-    log_assert(dev, dev->uri_escl != NULL);
+    log_assert(dev, uri != NULL);
 
     /* Make sure eSCL URI's path ends with '/' character */
-    const char *path = http_uri_get_path(dev->uri_escl);
+    path = http_uri_get_path(uri);
     if (!g_str_has_suffix(path, "/")) {
         size_t len = strlen(path);
         char *path2 = g_alloca(len + 2);
         memcpy(path2, path, len);
         path2[len] = '/';
         path2[len+1] = '\0';
-        http_uri_set_path(dev->uri_escl, path2);
+        http_uri_set_path(uri, path2);
     }
 
-    /* Fetch device capabilities */
-    device_http_get(dev, "ScannerCapabilities",
-            device_scanner_capabilities_callback);
+    return uri;
 }
 
-/* ScannerCapabilities fetch callback
+/* Switch device to another address
  */
 static void
-device_scanner_capabilities_callback (device *dev, http_query *q)
+device_addr_switch (device *dev, zeroconf_addrinfo *addrinfo)
 {
-    error err = NULL;
+    http_uri_free(dev->uri_escl);
+    dev->uri_escl = device_probe_uri(dev, addrinfo);
+    dev->addr_current = addrinfo;
+
+    log_debug(dev, "using %s", http_uri_str(dev->uri_escl));
+}
+
+/* Compare device_addr by RTT, for g_ptr_array_sort
+ */
+static gint
+device_addr_cmp (gconstpointer p1, gconstpointer p2)
+{
+    const device_addr *a1 = *(device_addr**) p1;
+    const device_addr *a2 = *(device_addr**) p2;
+
+    if (a1->rtt != a2->rtt) {
+        return a1->rtt < a2->rtt ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* Add responded address to the ranking
+ */
+static void
+device_addr_rank (device *dev, zeroconf_addrinfo *addrinfo, gint64 rtt)
+{
+    device_addr *addr = g_new0(device_addr, 1);
+
+    addr->addrinfo = addrinfo;
+    addr->rtt = rtt;
+    g_ptr_array_add(dev->addr_rank, addr);
+    g_ptr_array_sort(dev->addr_rank, device_addr_cmp);
+
+    log_debug(dev, "%s: RTT %d ms", addrinfo->uri, (int) (rtt / 1000));
+}
+
+/* Choose the fastest address for the next job. Called
+ * when device is idle, so switching is safe
+ */
+static void
+device_addr_select (device *dev)
+{
+    device_addr *best;
+
+    dev->addr_failover = 0;
+    if (dev->addr_rank->len == 0) {
+        return;
+    }
+
+    best = g_ptr_array_index(dev->addr_rank, 0);
+    if (best->addrinfo != dev->addr_current) {
+        device_addr_switch(dev, best->addrinfo);
+    }
+}
+
+/* Switch to the next best address after transport error. The
+ * failed address is moved to the end of the ranking. Returns
+ * false, if there are no more addresses to try
+ */
+static bool
+device_addr_failover (device *dev)
+{
+    unsigned int i;
+    device_addr  *failed = NULL, *next;
+
+    if (dev->addr_failover + 1 >= (int) dev->addr_rank->len) {
+        return false;
+    }
+
+    for (i = 0; i < dev->addr_rank->len; i ++) {
+        device_addr *addr = g_ptr_array_index(dev->addr_rank, i);
+        if (addr->addrinfo == dev->addr_current) {
+            failed = addr;
+            break;
+        }
+    }
+
+    if (failed != NULL) {
+        g_ptr_array_remove_index(dev->addr_rank, i);
+        failed->rtt = G_MAXINT64;
+        g_ptr_array_add(dev->addr_rank, failed);
+    }
+
+    next = g_ptr_array_index(dev->addr_rank, 0);
+    if (next == failed) {
+        return false;
+    }
+
+    dev->addr_failover ++;
+    log_debug(dev, "failover from %s", dev->addr_current->uri);
+    device_addr_switch(dev, next->addrinfo);
+
+    return true;
+}
+
+/* Free device_probe. If query is still pending, it is cancelled
+ */
+static void
+device_probe_free (device_probe *probe)
+{
+    if (probe->q != NULL) {
+        http_query_cancel(probe->q);
+    }
+
+    g_free(probe);
+}
+
+/* Cancel all pending probes
+ */
+static void
+device_probe_cancel (device *dev)
+{
+    unsigned int i;
+
+    if (dev->probe_timer != NULL) {
+        eloop_timer_cancel(dev->probe_timer);
+        dev->probe_timer = NULL;
+    }
+
+    for (i = 0; i < dev->probes->len; i ++) {
+        device_probe_free(g_ptr_array_index(dev->probes, i));
+    }
+
+    g_ptr_array_set_size(dev->probes, 0);
+    dev->addr_next = NULL;
+}
+
+/* dev->probe_timer callback
+ */
+static void
+device_probe_timer_callback (void *data)
+{
+    device *dev = data;
+
+    dev->probe_timer = NULL;
+    device_probe_start(dev);
+}
+
+/* Start probing of the next device address. Remaining addresses,
+ * if any, will be probed after a short delay, without waiting for
+ * completion of this probe (a.k.a. "happy eyeballs"), so a dead
+ * address doesn't delay device readiness
+ *
+ * All addresses are probed, even after device became ready, to
+ * rank them by round trip time. Probes run on the background
+ * http_client, so their failures don't affect scan jobs
+ */
+static void
+device_probe_start (device *dev)
+{
+    device_probe *probe;
+    http_uri     *base, *uri;
+
+    if (dev->probe_timer != NULL) {
+        eloop_timer_cancel(dev->probe_timer);
+        dev->probe_timer = NULL;
+    }
+
+    if (dev->addr_next == NULL) {
+        return;
+    }
+
+    probe = g_new0(device_probe, 1);
+    probe->addrinfo = dev->addr_next;
+    dev->addr_next = dev->addr_next->next;
+
+    base = device_probe_uri(dev, probe->addrinfo);
+    log_debug(dev, "probing %s", http_uri_str(base));
+
+    /* Fetch device capabilities */
+    uri = http_uri_new_relative(base, "ScannerCapabilities", true, false);
+    http_uri_free(base);
+
+    probe->start = g_get_monotonic_time();
+    probe->q = http_query_new(dev->http_background, uri, "GET", NULL, NULL,
+            device_scanner_capabilities_callback);
+    g_ptr_array_add(dev->probes, probe);
+
+    if (dev->addr_next != NULL) {
+        dev->probe_timer = eloop_timer_new(DEVICE_PROBE_STAGGER,
+                device_probe_timer_callback, dev);
+    }
+}
+
+/* Find pending probe by its query and remove it from the list
+ */
+static device_probe*
+device_probe_take (device *dev, http_query *q)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->probes->len; i ++) {
+        device_probe *probe = g_ptr_array_index(dev->probes, i);
+        if (probe->q == q) {
+            probe->q = NULL;
+            g_ptr_array_remove_index(dev->probes, i);
+            return probe;
+        }
+    }
+
+    return NULL;
+}
+
+/* Mark device as ready
+ */
+static void
+device_set_ready (device *dev)
+{
+    gint64 now = g_get_monotonic_time();
+
+    log_debug(dev, "device ready in %d ms%s",
+            (int) ((now - dev->add_time) / 1000),
+            (dev->flags & DEVICE_INIT_WAIT) != 0 &&
+                now > device_init_deadline(dev) ? ", after deadline" : "");
+
+    device_flags_update(dev, DEVICE_READY,
+            DEVICE_INIT_WAIT | DEVICE_LAZY | DEVICE_PROBING);
+
+    http_client_onerror(dev->http_client, device_http_onerror);
+    g_cond_broadcast(&device_table_cond);
+}
+
+/* Save device capabilities into the cache
+ */
+static void
+device_caps_save (device *dev, http_data *data)
+{
+    if (dev->caps_key != NULL) {
+        capscache_save(dev->caps_key, data->bytes, data->size);
+    }
+}
+
+/* Load device capabilities from the cache. Device is keyed by
+ * its UUID, if known, or by URI otherwise.
+ *
+ * On success, device becomes ready immediately, using its first
+ * address. Probes, started then, revalidate cached capabilities
+ * and rank device addresses, as usual
+ */
+static void
+device_caps_load (device *dev)
+{
+    zeroconf_addrinfo *addrinfo;
+    char              *data;
+    size_t            size;
+    error             err;
+
+    if (!conf.caps_cache || dev->addresses == NULL) {
+        return;
+    }
+
+    dev->caps_key = g_strdup(dev->addresses->uri);
+    for (addrinfo = dev->addresses; addrinfo != NULL;
+            addrinfo = addrinfo->next) {
+        if (addrinfo->uuid != NULL) {
+            g_free(dev->caps_key);
+            dev->caps_key = g_strdup(addrinfo->uuid);
+            break;
+        }
+    }
+
+    data = capscache_load(dev->caps_key, &size);
+    if (data == NULL) {
+        return;
+    }
+
+    err = devopt_import_caps(&dev->opt, data, size);
+    if (err != NULL) {
+        log_debug(dev, "cached ScannerCapabilities: %s", ESTRING(err));
+        devopt_cleanup(&dev->opt);
+        devopt_init(&dev->opt);
+    } else {
+        log_debug(dev, "ScannerCapabilities loaded from cache");
+        dev->caps_hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+                (const guchar*) data, size);
+
+        device_addr_switch(dev, dev->addresses);
+        devcaps_dump(dev->trace, &dev->opt.caps);
+        device_quirks_apply(dev);
+        device_set_ready(dev);
+    }
+
+    g_free(data);
+}
+
+/* Revalidate capabilities, loaded from cache, against the actual
+ * device response. If they differ, cache is updated and, unless
+ * device is opened, capabilities are reloaded. Opened device keeps
+ * its capabilities, as application already uses its options
+ */
+static void
+device_caps_revalidate (device *dev, http_data *data)
+{
+    char   *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256,
+            data->bytes, data->size);
+    bool   same = !strcmp(hash, dev->caps_hash);
+    devopt opt;
+    error  err;
+
+    g_free(hash);
+    g_free(dev->caps_hash);
+    dev->caps_hash = NULL;
+
+    if (same) {
+        log_debug(dev, "cached ScannerCapabilities are up to date");
+        return;
+    }
+
+    /* Make sure new capabilities are valid, before dropping old ones */
+    devopt_init(&opt);
+    err = devopt_import_caps(&opt, data->bytes, data->size);
+    devopt_cleanup(&opt);
+
+    if (err != NULL) {
+        log_debug(dev, "ScannerCapabilities: %s", ESTRING(err));
+        return;
+    }
+
+    log_debug(dev, "cached ScannerCapabilities are outdated, updating");
+    device_caps_save(dev, data);
+
+    if ((dev->flags & DEVICE_OPENED) == 0) {
+        devopt_cleanup(&dev->opt);
+        devopt_init(&dev->opt);
+        devopt_import_caps(&dev->opt, data->bytes, data->size);
+        devcaps_dump(dev->trace, &dev->opt.caps);
+        device_quirks_apply(dev);
+    }
+}
+
+/* ScannerCapabilities fetch callback
+ */
+static void
+device_scanner_capabilities_callback (device *dev, http_query *q)
+{
+    error        err = NULL;
+    device_probe *probe = device_probe_take(dev, q);
+    gint64       rtt;
+
+    log_assert(dev, probe != NULL);
+    rtt = g_get_monotonic_time() - probe->start;
 
     /* Check request status */
     err = http_query_error(q);
@@ -495,8 +1491,27 @@ device_scanner_capabilities_callback (device *dev, http_query *q)
         goto DONE;
     }
 
-    /* Parse XML response */
     http_data *data = http_query_get_response_data(q);
+
+    /* If device is already initialized, just rank the address.
+     * If capabilities were loaded from cache, revalidate them
+     */
+    if (dev->uri_escl != NULL) {
+        device_addr_rank(dev, probe->addrinfo, rtt);
+        device_probe_free(probe);
+
+        if (dev->caps_hash != NULL) {
+            device_caps_revalidate(dev, data);
+        }
+
+        if ((dev->flags & (DEVICE_LAZY | DEVICE_PROBING)) != 0) {
+            device_flags_update(dev, 0, DEVICE_LAZY | DEVICE_PROBING);
+            g_cond_broadcast(&device_table_cond);
+        }
+        return;
+    }
+
+    /* Parse XML response */
     err = devopt_import_caps(&dev->opt, data->bytes, data->size);
 
     if (err != NULL) {
@@ -504,27 +1519,43 @@ device_scanner_capabilities_callback (device *dev, http_query *q)
         goto DONE;
     }
 
+    /* The first responder is used, until other
+     * addresses are ranked
+     */
+    device_addr_rank(dev, probe->addrinfo, rtt);
+    device_addr_switch(dev, probe->addrinfo);
+    device_caps_save(dev, data);
+
     devcaps_dump(dev->trace, &dev->opt.caps);
+    device_quirks_apply(dev);
 
     /* Cleanup and exit */
 DONE:
+    device_probe_free(probe);
+
     if (err != NULL) {
         log_debug(dev, ESTRING(err));
         trace_error(dev->trace, err);
 
-        if (dev->addr_current != NULL && dev->addr_current->next != NULL) {
-            device_probe_address(dev, dev->addr_current->next);
-        } else {
-            device_del(dev);
+        if (dev->addr_next != NULL) {
+            /* Don't wait for stagger delay, start next probe now */
+            device_probe_start(dev);
+        } else if (dev->probes->len == 0) {
+            /* All probes failed, wake up device_open(), if waiting */
+            device_flags_update(dev, 0, DEVICE_PROBING);
+
+            /* If device was listed from the cache, but none of its
+             * addresses has responded, cached data is stale
+             */
+            if (dev->uri_escl == NULL || dev->caps_hash != NULL) {
+                device_del(dev);
+            }
+
+            g_cond_broadcast(&device_table_cond);
         }
     } else {
-        dev->flags |= DEVICE_READY;
-        dev->flags &= ~DEVICE_INIT_WAIT;
-
-        http_client_onerror(dev->http_client, device_http_onerror);
+        device_set_ready(dev);
     }
-
-    g_cond_broadcast(&device_table_cond);
 }
 
 /******************** ESCL scanning ********************/
@@ -551,6 +1582,40 @@ device_escl_cleanup (device *dev)
             device_escl_cleanup_callback);
 }
 
+/* HTTP DELETE ${dev->job_location} callback, for background cleanup
+ */
+static void
+device_escl_cleanup_background_callback (device *dev, http_query *q)
+{
+    error err = http_query_error(q);
+
+    if (err != NULL) {
+        log_debug(dev, "background cleanup: %s", ESTRING(err));
+    }
+}
+
+/* ESCL: cleanup after successfully completed scan in background
+ *
+ * The job is considered done immediately, so the next job may be
+ * started without waiting for the DELETE round trip. The DELETE
+ * request runs on a separate http_client, so it is not affected
+ * by cancellation of the next job's requests. Its failure is
+ * harmless, as device will drop the job anyway
+ *
+ * HTTP DELETE ${dev->job_location}
+ */
+static void
+device_escl_cleanup_background (device *dev)
+{
+    http_uri *uri = http_uri_new_relative(dev->uri_escl,
+            dev->job_location->str, true, false);
+
+    http_query_new(dev->http_background, uri, "DELETE", NULL, NULL,
+            device_escl_cleanup_background_callback);
+
+    device_state_set(dev, DEVICE_SCAN_DONE);
+}
+
 /* Parse ScannerStatus response.
  */
 static SANE_Status
@@ -652,6 +1717,9 @@ device_escl_check_status_callback (device *dev, http_query *q)
         status = device_escl_decode_scanner_status(dev, data->bytes, data->size);
     }
 
+    dev->http_status_time = g_get_monotonic_time();
+    dev->http_status_busy = status == SANE_STATUS_DEVICE_BUSY;
+
     /* Now it't time to take a decision */
     if (dev->checking_state == DEVICE_SCAN_LOADING &&
         dev->checking_http_status == HTTP_STATUS_SERVICE_UNAVAILABLE ) {
@@ -660,17 +1728,16 @@ device_escl_check_status_callback (device *dev, http_query *q)
          * on attempt to load page immediately after job is created
          *
          * So if status doesn't cleanly indicate any error, lets retry
-         * several times
+         * for a while
          */
         switch (status) {
         case SANE_STATUS_GOOD:
         case SANE_STATUS_UNSUPPORTED:
         case SANE_STATUS_DEVICE_BUSY:
-                if ( dev->http_retry + 1 < DEVICE_HTTP_RETRY_ATTEMPTS) {
-                    dev->http_retry ++;
-                    device_escl_load_retry(dev);
-                }
+            if (device_escl_load_retry(dev)) {
                 return;
+            }
+            break;
         default:
             break;
         }
@@ -690,11 +1757,16 @@ device_escl_check_status_callback (device *dev, http_query *q)
         device_job_set_status(dev, status);
     }
 
-    /* Finish the job */
-    if (dev->job_has_location) {
-        device_escl_cleanup(dev);
-    } else {
+    /* Finish the job. If some images were received (i.e., ADF
+     * is empty now), job has completed normally, so cleanup
+     * doesn't need to delay the next job
+     */
+    if (!dev->job_has_location) {
         device_state_set(dev, DEVICE_SCAN_DONE);
+    } else if (dev->job_images_received != 0) {
+        device_escl_cleanup_background(dev);
+    } else {
+        device_escl_cleanup(dev);
     }
 }
 
@@ -723,47 +1795,501 @@ device_escl_load_retry_callback (void *data) {
     device_escl_load_page(dev);
 }
 
+/* Compute pause before the next retry, in milliseconds
+ *
+ * If the first page is expected to be ready soon, based on the
+ * latency, learned from previous jobs, we wait until then.
+ * Otherwise, pause grows exponentially with each attempt
+ */
+static int
+device_escl_load_retry_pause (device *dev)
+{
+    gint64 elapsed = g_get_monotonic_time() - dev->job_start_time;
+    gint64 pause;
+
+    if (dev->job_images_received == 0 && dev->page_latency > elapsed) {
+        pause = (dev->page_latency - elapsed) / 1000;
+    } else {
+        pause = DEVICE_HTTP_RETRY_PAUSE_MIN;
+        pause <<= math_min(dev->http_retry - 1, 16);
+    }
+
+    pause = math_bound(pause, DEVICE_HTTP_RETRY_PAUSE_MIN,
+            DEVICE_HTTP_RETRY_PAUSE_MAX);
+
+    pause += pause * g_random_int_range(-DEVICE_HTTP_RETRY_JITTER,
+            DEVICE_HTTP_RETRY_JITTER + 1) / 100;
+
+    return (int) pause;
+}
+
 /* Retry HTTP GET ${dev->job_location}/NextDocument
- * after some delay
+ * after some delay. Returns false, if retry timeout
+ * has expired
  */
-static void
+static bool
 device_escl_load_retry (device *dev) {
+    gint64 now = g_get_monotonic_time();
+    int    pause;
+
+    if (dev->http_retry == 0) {
+        dev->http_retry_start = now;
+    } else if (now - dev->http_retry_start >
+               DEVICE_HTTP_RETRY_TIMEOUT * G_TIME_SPAN_SECOND) {
+        return false;
+    }
+
+    dev->http_retry ++;
+    pause = device_escl_load_retry_pause(dev);
+
+    log_debug(dev, "retry #%d in %d ms", dev->http_retry, pause);
+
     device_state_set(dev, DEVICE_SCAN_LOAD_RETRY);
-    dev->http_timer = eloop_timer_new(DEVICE_HTTP_RETRY_PAUSE * 1000,
+    dev->http_timer = eloop_timer_new(pause,
             device_escl_load_retry_callback, dev);
+
+    return true;
 }
 
-/* HTTP GET ${dev->job_location}/NextDocument callback
+/* Handle HTTP 503 reply to NextDocument request. If scanner
+ * recently reported that it is processing the job, retry
+ * immediately, without yet another ScannerStatus round trip.
+ * Otherwise, check scanner status first
  */
 static void
-device_escl_load_page_callback (device *dev, http_query *q)
+device_escl_load_unavailable (device *dev, int http_status)
 {
-    error err;
+    gint64 now = g_get_monotonic_time();
 
-    /* Try to fetch next page until previous page fetched successfully */
-    err = http_query_error(q);
-    if (err == NULL) {
-        http_data *data = http_query_get_response_data(q);
+    if (dev->http_retry != 0 && dev->http_status_busy &&
+        now - dev->http_status_time <
+            DEVICE_HTTP_STATUS_INTERVAL * G_TIME_SPAN_MILLISECOND) {
+        if (device_escl_load_retry(dev)) {
+            return;
+        }
+    }
 
-        g_ptr_array_add(dev->job_images, http_data_ref(data));
-        dev->job_images_received ++;
-        dev->http_retry = 0;
+    device_escl_check_status(dev, http_status);
+}
 
-        if (dev->job_images_received == 1) {
-            if (!device_read_push(dev)) {
-                device_job_abort(dev, SANE_STATUS_IO_ERROR);
-                return;
-            }
+/* Learn latency of the first page of the job, i.e., time
+ * between job creation and the first successful NextDocument
+ * response. Estimation is smoothed across jobs
+ */
+static void
+device_escl_learn_latency (device *dev)
+{
+    gint64 latency = g_get_monotonic_time() - dev->job_start_time;
+
+    if (dev->page_latency == 0) {
+        dev->page_latency = latency;
+    } else {
+        dev->page_latency = (dev->page_latency * 3 + latency) / 4;
+    }
+
+    log_debug(dev, "first page latency: %d ms, estimated: %d ms",
+            (int) (latency / 1000), (int) (dev->page_latency / 1000));
+}
+
+/* Queue received (or being received) page for reading.
+ * Returns false, if job was aborted
+ */
+static bool
+device_escl_load_page_queue (device *dev, device_page *page)
+{
+    g_ptr_array_add(dev->job_images, device_page_ref(page));
+    g_cond_broadcast(&dev->state_cond);
+
+    if (dev->job_images_received == 0 && dev->read_page == NULL) {
+        if (!device_read_push(dev)) {
+            device_job_abort(dev, SANE_STATUS_IO_ERROR);
+            return false;
         }
+    }
 
-        if (dev->opt.src == OPT_SOURCE_PLATEN) {
-            device_escl_cleanup(dev);
+    return true;
+}
+
+/* Page spooling task. Spool file is written by the spool worker,
+ * and then page is switched to it on a context of the event loop
+ * thread, so writing doesn't block the event loop
+ */
+typedef struct {
+    device      *dev;   /* Device that owns the page */
+    device_page *page;  /* Page being spooled */
+    int         fd;     /* Spool file, -1 on error */
+    char        *err;   /* Error message, if any */
+} device_spool_task;
+
+/* Keep the page in memory. It is counted in memory budget
+ * and may be decoded ahead
+ */
+static void
+device_escl_load_page_keep (device *dev, device_page *page)
+{
+    page->accounted = true;
+    dev->job_images_mem += page->data->size;
+    device_decode_ahead_schedule(page);
+}
+
+/* Finish page spooling - runs on a context of event loop thread
+ *
+ * If page was claimed meanwhile (i.e., reading of it has been
+ * started or job is finished), its in-memory data may be in use,
+ * so spool file is just discarded. The task itself is released
+ * by device_escl_load_page_spool_free()
+ */
+static gboolean
+device_escl_load_page_spool_done (gpointer data)
+{
+    device_spool_task *task = data;
+    device            *dev = task->dev;
+    device_page       *page = task->page;
+    bool              claimed;
+
+    claimed = g_atomic_int_get(&page->state) == DEVICE_PAGE_CLAIMED;
+
+    if (task->err != NULL) {
+        log_debug(dev, "%s", task->err);
+        if (!claimed) {
+            device_escl_load_page_keep(dev, page);
+        }
+    } else if (!claimed) {
+        page->spool_fd = task->fd;
+        page->spool_size = page->data->size;
+        task->fd = -1;
+        http_data_unref(page->data);
+        page->data = NULL;
+        log_debug(dev, "page spooled to disk, %zu bytes", page->spool_size);
+    }
+
+    return FALSE;
+}
+
+/* Release page spooling task. Called after
+ * device_escl_load_page_spool_done(), or instead of it,
+ * if event loop is destroyed before the task is finished
+ */
+static void
+device_escl_load_page_spool_free (gpointer data)
+{
+    device_spool_task *task = data;
+
+    if (task->fd >= 0) {
+        close(task->fd);
+    }
+
+    device_page_unref(task->page);
+    device_unref(task->dev);
+    g_free(task->err);
+    g_free(task);
+}
+
+/* Spool worker pool task
+ */
+static void
+device_escl_load_page_spool_task (gpointer data, gpointer user_data)
+{
+    device_spool_task *task = data;
+
+    (void) user_data;
+
+    task->fd = device_page_spool_write(task->page, &task->err);
+    eloop_call_full(device_escl_load_page_spool_done, task,
+            device_escl_load_page_spool_free);
+}
+
+/* Store completely received page, that waits in the queue for
+ * reading. Page is kept in memory, if it fits the memory budget,
+ * and may be decoded ahead. Otherwise, it is spooled to disk
+ * in background
+ */
+static void
+device_escl_load_page_store (device *dev, device_page *page)
+{
+    size_t size = page->data->size;
+
+    if (device_spool_pool != NULL &&
+        dev->job_images_mem + size > conf.spool_memory) {
+        device_spool_task *task = g_new0(device_spool_task, 1);
+
+        task->dev = device_ref(dev);
+        task->page = device_page_ref(page);
+        task->fd = -1;
+        g_thread_pool_push(device_spool_pool, task, NULL);
+        return;
+    }
+
+    device_escl_load_page_keep(dev, page);
+}
+
+/* Drop partially received page, if any. Called when page
+ * loading fails or cancelled
+ *
+ * If page is still queued, it is removed from the queue. If
+ * page is being read, reader will notice that page will never
+ * be completed
+ */
+static void
+device_escl_load_page_drop (device *dev)
+{
+    device_page *page = dev->job_image_loading;
+
+    if (page != NULL) {
+        dev->job_image_loading = NULL;
+
+        g_rec_mutex_lock(&dev->read_lock);
+        dev->read_loading = false;
+        g_rec_mutex_unlock(&dev->read_lock);
+
+        if (g_ptr_array_remove(dev->job_images, page)) {
+            device_read_queue_forget(dev, page);
+            device_page_unref(page);
+        }
+        device_page_unref(page);
+
+        if ((dev->flags & DEVICE_SCANNING) != 0) {
+            pollable_signal(dev->read_pollable);
+            pollable_signal(dev->read_worker_wakeup);
+        }
+    }
+}
+
+/* Find pending NextDocument request by http_query. Returns
+ * its index in dev->job_loaders, or -1, if not found
+ */
+static int
+device_escl_load_page_find (device *dev, http_query *q)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->job_loaders->len; i ++) {
+        device_loader *loader = g_ptr_array_index(dev->job_loaders, i);
+        if (loader->q == q) {
+            return (int) i;
+        }
+    }
+
+    return -1;
+}
+
+/* Free device_loader
+ */
+static void
+device_escl_load_page_free (device_loader *loader)
+{
+    http_data_unref(loader->data);
+    g_free(loader);
+}
+
+/* Cancel all pending NextDocument requests. Called when
+ * job is cancelled or failed
+ */
+static void
+device_escl_load_page_purge (device *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->job_loaders->len; i ++) {
+        device_loader *loader = g_ptr_array_index(dev->job_loaders, i);
+
+        if (loader->q != NULL) {
+            http_query_cancel(loader->q);
+        }
+
+        device_escl_load_page_free(loader);
+    }
+
+    g_ptr_array_set_size(dev->job_loaders, 0);
+}
+
+/* Request next ADF page ahead of time, if allowed
+ *
+ * It is only done, if all pending requests already responded
+ * with HTTP 200, so 404 (end of job) and 503 (not ready yet)
+ * responses always terminate the sequence of pending requests
+ */
+static void
+device_escl_load_page_prefetch (device *dev)
+{
+    unsigned int  len = dev->job_loaders->len;
+    device_loader *last;
+
+    if (dev->opt.src == OPT_SOURCE_PLATEN || dev->job_cancel_rq ||
+        len == 0 || len >= (unsigned int) conf.adf_prefetch) {
+        return;
+    }
+
+    last = g_ptr_array_index(dev->job_loaders, len - 1);
+    if (last->hdr_ok) {
+        device_escl_load_page(dev);
+    }
+}
+
+/* HTTP GET ${dev->job_location}/NextDocument response
+ * headers callback
+ */
+static void
+device_escl_load_page_onrxhdr (device *dev, http_query *q)
+{
+    int idx = device_escl_load_page_find(dev, q);
+
+    if (idx >= 0 && http_query_status(q) == HTTP_STATUS_OK) {
+        device_loader *loader = g_ptr_array_index(dev->job_loaders, idx);
+
+        if (idx == 0 && dev->job_images_received == 0) {
+            device_escl_learn_latency(dev);
+        }
+
+        loader->hdr_ok = true;
+        device_escl_load_page_prefetch(dev);
+    }
+}
+
+/* HTTP GET ${dev->job_location}/NextDocument incremental
+ * receive callback
+ *
+ * Page is queued for reading as soon as its first portion
+ * arrives, so image decoding overlaps with page downloading.
+ * Pages, requested ahead of time, are received in background,
+ * until all previous pages are received
+ */
+static void
+device_escl_load_page_onrxdata (device *dev, http_query *q)
+{
+    http_data *data;
+
+    /* Erroneous replies are handled on completion */
+    if (http_query_status(q) != HTTP_STATUS_OK) {
+        return;
+    }
+
+    if (device_escl_load_page_find(dev, q) != 0) {
+        return;
+    }
+
+    if (dev->job_image_loading == NULL) {
+        data = http_query_get_response_data(q);
+        dev->job_image_loading = device_page_new(dev, data);
+        if (!device_escl_load_page_queue(dev, dev->job_image_loading)) {
+            return;
+        }
+    }
+
+    device_read_update(dev, dev->job_image_loading, true);
+}
+
+/* Handle completion of the first pending NextDocument request
+ */
+static void
+device_escl_load_page_done (device *dev, bool ok, int status, http_data *data)
+{
+    device_page   *page = dev->job_image_loading;
+    device_loader *loader;
+    bool          page_ok;
+
+    /* Try to fetch next page until previous page fetched successfully */
+    if (!ok) {
+        device_escl_load_page_purge(dev);
+        device_escl_load_page_drop(dev);
+
+        if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+            device_escl_load_unavailable(dev, status);
         } else {
-            device_escl_load_page(dev);
+            device_escl_check_status(dev, status);
         }
+        return;
+    }
+
+    dev->job_image_loading = NULL;
+    if (page == NULL) {
+        page = device_page_new(dev, data);
+        if (!device_escl_load_page_queue(dev, page)) {
+            device_page_unref(page);
+            return;
+        }
+    }
+
+    dev->job_images_received ++;
+    dev->http_retry = 0;
+
+    page_ok = device_read_update(dev, page, false);
+    if (page_ok && g_atomic_int_get(&page->state) != DEVICE_PAGE_CLAIMED) {
+        device_escl_load_page_store(dev, page);
+    }
+
+    device_page_unref(page);
+    if (!page_ok) {
+        return;
+    }
+
+    if (dev->opt.src == OPT_SOURCE_PLATEN) {
+        device_escl_cleanup_background(dev);
+        return;
+    }
+
+    /* Proceed with the next page */
+    if (dev->job_loaders->len == 0) {
+        device_escl_load_page(dev);
+        return;
+    }
+
+    loader = g_ptr_array_index(dev->job_loaders, 0);
+    if (loader->q == NULL) {
+        /* Already received in background */
+        g_ptr_array_remove_index(dev->job_loaders, 0);
+        device_escl_load_page_done(dev, loader->ok, loader->status,
+                loader->data);
+        device_escl_load_page_free(loader);
     } else {
-        device_escl_check_status(dev, http_query_status(q));
+        /* Still receiving; continue incrementally */
+        if (loader->hdr_ok &&
+            http_query_get_response_data(loader->q)->size != 0) {
+            device_escl_load_page_onrxdata(dev, loader->q);
+        }
+        device_escl_load_page_prefetch(dev);
+    }
+}
+
+/* HTTP GET ${dev->job_location}/NextDocument callback
+ */
+static void
+device_escl_load_page_callback (device *dev, http_query *q)
+{
+    int           idx = device_escl_load_page_find(dev, q);
+    device_loader *loader;
+    bool          ok = http_query_error(q) == NULL;
+
+    log_assert(dev, idx >= 0);
+    loader = g_ptr_array_index(dev->job_loaders, idx);
+
+    if (idx != 0) {
+        /* Previous page is not received yet, so just keep the result */
+        loader->q = NULL;
+        loader->ok = ok;
+        loader->status = http_query_status(q);
+        loader->data = http_data_ref(http_query_get_response_data(q));
+        return;
     }
+
+    g_ptr_array_remove_index(dev->job_loaders, 0);
+    device_escl_load_page_free(loader);
+
+    device_escl_load_page_done(dev, ok, http_query_status(q),
+            http_query_get_response_data(q));
+}
+
+/* Estimate max size of the page image, as sent by device. Compressed
+ * image hardly exceeds uncompressed 24-bit image at the scan resolution,
+ * so this is used to limit response data preallocation
+ */
+static size_t
+device_escl_load_page_max_size (device *dev)
+{
+    size_t pixels = (size_t) dev->opt.params.pixels_per_line *
+            (size_t) dev->opt.params.lines;
+
+    return pixels * dev->job_scale * dev->job_scale * 3;
 }
 
 /* ESCL: load next page
@@ -773,7 +2299,9 @@ device_escl_load_page_callback (device *dev, http_query *q)
 static void
 device_escl_load_page (device *dev)
 {
-    size_t sz = dev->job_location->len;
+    size_t        sz = dev->job_location->len;
+    device_loader *loader = g_new0(device_loader, 1);
+
     if (sz == 0 || dev->job_location->str[sz-1] != '/') {
         g_string_append_c(dev->job_location, '/');
     }
@@ -781,10 +2309,83 @@ device_escl_load_page (device *dev)
 
     device_state_set(dev, DEVICE_SCAN_LOADING);
 
-    device_http_get(dev, dev->job_location->str, device_escl_load_page_callback);
+    loader->q = device_http_get(dev, dev->job_location->str,
+            device_escl_load_page_callback);
+    http_query_onrxhdr(loader->q, device_escl_load_page_onrxhdr);
+    http_query_onrxdata(loader->q, device_escl_load_page_onrxdata);
+    http_query_rxlock(loader->q, &dev->read_lock);
+    http_query_rxprealloc(loader->q, device_escl_load_page_max_size(dev));
+    g_ptr_array_add(dev->job_loaders, loader);
+
     g_string_truncate(dev->job_location, sz);
 }
 
+/* Retry failed request on the next best device address
+ *
+ * Only idempotent requests are retried, and only if it is safe:
+ * NextDocument is not retried, if some page data already received,
+ * as we can't know what the scanner will send next time. Returns
+ * true, if request is retried
+ */
+static bool
+device_escl_failover (device *dev)
+{
+    unsigned int i;
+
+    switch (dev->state) {
+    case DEVICE_SCAN_LOADING:
+        if (dev->job_image_loading != NULL) {
+            return false;
+        }
+
+        for (i = 0; i < dev->job_loaders->len; i ++) {
+            device_loader *loader = g_ptr_array_index(dev->job_loaders, i);
+            if (loader->hdr_ok) {
+                return false;
+            }
+        }
+        break;
+
+    case DEVICE_SCAN_CHECK_STATUS:
+    case DEVICE_SCAN_CLEANING_UP:
+        break;
+
+    default:
+        return false;
+    }
+
+    if (!device_addr_failover(dev)) {
+        return false;
+    }
+
+    /* Note, the failed query is detached from its loader by
+     * device_http_onerror(), so purge only cancels the rest
+     */
+    device_escl_load_page_purge(dev);
+    http_client_cancel(dev->http_client);
+
+    switch (dev->state) {
+    case DEVICE_SCAN_LOADING:
+        device_escl_load_page(dev);
+        break;
+
+    case DEVICE_SCAN_CHECK_STATUS:
+        device_http_get(dev, "ScannerStatus",
+                device_escl_check_status_callback);
+        break;
+
+    case DEVICE_SCAN_CLEANING_UP:
+        device_http_perform(dev, dev->job_location->str, "DELETE", NULL,
+                device_escl_cleanup_callback);
+        break;
+
+    default:
+        break;
+    }
+
+    return true;
+}
+
 /* HTTP POST ${dev->uri_escl}/ScanJobs callback
  */
 static void
@@ -820,6 +2421,7 @@ device_escl_start_scan_callback (device *dev, http_query *q)
 
     g_string_assign(dev->job_location, http_uri_get_path(uri));
     dev->job_has_location = true;
+    dev->job_start_time = g_get_monotonic_time();
     http_uri_free(uri);
 
     /* Check for pending cancellation */
@@ -922,8 +2524,8 @@ device_escl_start_scan (device *dev)
     bool           duplex = false;
     const char     *mime = "image/jpeg";
     //const char     *mime = "application/pdf";
-    SANE_Word      x_resolution = dev->opt.resolution;
-    SANE_Word      y_resolution = dev->opt.resolution;
+    SANE_Word      x_resolution = dev->opt.scan_resolution;
+    SANE_Word      y_resolution = dev->opt.scan_resolution;
     devcaps_source *src = dev->opt.caps.src[dev->opt.src];
     device_geom    geom_x, geom_y;
     char           buf[64];
@@ -935,8 +2537,22 @@ device_escl_start_scan (device *dev)
     geom_y = device_geom_compute(dev->opt.tl_y, dev->opt.br_y,
         src->min_hei_px, src->max_hei_px, y_resolution);
 
-    dev->job_skip_x = geom_x.skip;
-    dev->job_skip_y = geom_y.skip;
+    /* Use the fastest address for the new job */
+    device_addr_select(dev);
+
+    /* Skip is computed for the scan resolution, and image
+     * will be downscaled
+     */
+    dev->job_scale = dev->opt.scale;
+    dev->job_skip_x = geom_x.skip / dev->job_scale;
+    dev->job_skip_y = geom_y.skip / dev->job_scale;
+
+    /* Choose image format */
+    dev->job_png = conf.prefer_png &&
+            (src->flags & DEVCAPS_SOURCE_FMT_PNG) != 0;
+    if (dev->job_png) {
+        mime = "image/png";
+    }
 
     /* Prepare other parameters */
     switch (dev->opt.src) {
@@ -975,6 +2591,7 @@ device_escl_start_scan (device *dev)
     trace_printf(dev->trace, "  image Y offset: %d", geom_y.off);
     trace_printf(dev->trace, "  x_resolution:   %d", x_resolution);
     trace_printf(dev->trace, "  y_resolution:   %d", y_resolution);
+    trace_printf(dev->trace, "  downscaling:    1/%d", dev->job_scale);
     trace_printf(dev->trace, "  image format:   %s", mime);
     trace_printf(dev->trace, "  duplex:         %s", duplex ? "true" : "false");
     trace_printf(dev->trace, "");
@@ -1093,17 +2710,40 @@ device_job_cancel_event_callback (void *data)
 
 /******************** API helpers ********************/
 /* Wait until list of devices is ready
+ *
+ * Devices, found during initial scan, are waited for until they
+ * become ready or their individual deadline expires, and the whole
+ * wait is bounded by the global deadline. Devices that become ready
+ * later will be returned by subsequent calls
  */
 static void
 device_list_sync (void)
 {
-    gint64 timeout = g_get_monotonic_time() +
-            DEVICE_TABLE_READY_TIMEOUT * G_TIME_SPAN_SECOND;
+    gint64       start = g_get_monotonic_time(), now = start;
+    gint64       timeout = start + (gint64) conf.list_timeout * 1000;
+    gint64       wakeup = timeout;
+    unsigned int pending;
+
+    for (;;) {
+        bool table_ready = device_table_ready(now, &wakeup);
+
+        if ((table_ready && !zeroconf_init_scan()) || now >= timeout) {
+            break;
+        }
 
-    while ((!device_table_ready() || zeroconf_init_scan()) &&
-            g_get_monotonic_time() < timeout) {
-        eloop_cond_wait_until(&device_table_cond, timeout);
+        /* Wait for event or for the nearest device deadline */
+        if (table_ready || wakeup > timeout) {
+            wakeup = timeout;
+        }
+
+        eloop_cond_wait_until(&device_table_cond, wakeup);
+        now = g_get_monotonic_time();
     }
+
+    pending = device_table_collect(DEVICE_INIT_WAIT, NULL);
+    log_debug(NULL, "device list: waited %d ms, %u ready, %u pending",
+            (int) ((now - start) / 1000),
+            device_table_collect(DEVICE_READY, NULL), pending);
 }
 
 /* Compare SANE_Device*, for qsort
@@ -1124,21 +2764,35 @@ device_list_get (void)
 
     /* Build a list */
     device            **devices = g_newa(device*, device_table_size());
-    unsigned int      count = device_table_collect(DEVICE_READY, devices);
+    unsigned int      count = device_table_collect(DEVICE_READY | DEVICE_LAZY,
+                                                   devices);
     unsigned int      i;
     const SANE_Device **dev_list = g_new0(const SANE_Device*, count + 1);
 
     for (i = 0; i < count; i ++) {
-        SANE_Device *info = g_new0(SANE_Device, 1);
+        SANE_Device       *info = g_new0(SANE_Device, 1);
+        zeroconf_addrinfo *addrinfo = devices[i]->addresses;
+
         dev_list[i] = info;
 
         info->name = g_strdup(devices[i]->name);
         if (conf.model_is_netname) {
             info->vendor = g_strdup("AirScan");
             info->model = g_strdup(devices[i]->name);
-        } else {
+        } else if ((devices[i]->flags & DEVICE_READY) != 0) {
             info->vendor = g_strdup(devices[i]->opt.caps.vendor);
             info->model = g_strdup(devices[i]->opt.caps.model);
+        } else {
+            /* Capabilities not fetched yet, use DNS-SD TXT data */
+            const char *vendor = NULL, *model = NULL;
+
+            if (addrinfo != NULL) {
+                vendor = addrinfo->vendor;
+                model = addrinfo->model;
+            }
+
+            info->vendor = g_strdup(vendor ? vendor : "AirScan");
+            info->model = g_strdup(model ? model : devices[i]->name);
         }
         info->type = "eSCL network scanner";
     }
@@ -1184,6 +2838,58 @@ device_trace (device *dev)
     return dev->trace;
 }
 
+/* Start probing of lazily listed device - runs on a context
+ * of event loop thread
+ */
+static gboolean
+device_open_probe_do (gpointer data)
+{
+    device *dev = data;
+
+    if ((dev->flags & DEVICE_LISTED) != 0) {
+        device_probe_start(dev);
+    }
+
+    device_unref(dev);
+
+    return FALSE;
+}
+
+/* Probe lazily listed device and wait until it becomes ready.
+ * If probing is already in progress (i.e., started by previous
+ * open attempt), just wait for it. Waiting is limited by the
+ * device_timeout; if probing doesn't finish in time, it continues
+ * in background and device remains listed, so next attempt to
+ * open the device may succeed
+ */
+static SANE_Status
+device_open_probe (device *dev)
+{
+    gint64      timeout = g_get_monotonic_time() +
+            (gint64) conf.device_timeout * 1000;
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    if ((dev->flags & DEVICE_PROBING) == 0) {
+        device_flags_update(dev, DEVICE_PROBING, 0);
+        eloop_call(device_open_probe_do, device_ref(dev));
+    }
+
+    device_ref(dev);
+    while ((dev->flags & (DEVICE_LISTED | DEVICE_PROBING | DEVICE_READY)) ==
+                (DEVICE_LISTED | DEVICE_PROBING) &&
+            g_get_monotonic_time() < timeout) {
+        eloop_cond_wait_until(&device_table_cond, timeout);
+    }
+
+    if ((dev->flags & DEVICE_READY) == 0) {
+        status = SANE_STATUS_IO_ERROR;
+    }
+
+    device_unref(dev);
+
+    return status;
+}
+
 /* Open a device
  */
 SANE_Status
@@ -1200,17 +2906,28 @@ device_open (const char *name, device **out)
         dev = device_find(name);
     } else {
         device          **devices = g_newa(device*, device_table_size());
-        unsigned int    count = device_table_collect(DEVICE_READY, devices);
+        unsigned int    count = device_table_collect(
+                DEVICE_READY | DEVICE_LAZY, devices);
         if (count > 0) {
             dev = devices[0];
         }
     }
 
-    if (dev == NULL || (dev->flags & DEVICE_READY) == 0) {
+    if (dev == NULL || (dev->flags & (DEVICE_READY | DEVICE_LAZY)) == 0) {
         return SANE_STATUS_INVAL;
     }
 
-    /* Check device state */
+    /* Probe lazily listed device */
+    if ((dev->flags & DEVICE_LAZY) != 0) {
+        SANE_Status status = device_open_probe(dev);
+        if (status != SANE_STATUS_GOOD) {
+            return status;
+        }
+    }
+
+    /* Check device state. Note, it may change while device is
+     * being probed
+     */
     if ((dev->flags & DEVICE_OPENED) != 0) {
         return SANE_STATUS_DEVICE_BUSY;
     }
@@ -1243,6 +2960,11 @@ device_close (device *dev)
             }
         }
 
+        /* Stop image decoding, if still in progress */
+        if ((dev->flags & DEVICE_SCANNING) != 0) {
+            device_read_finish(dev);
+        }
+
         /* Close the device */
         eloop_event_free(dev->job_cancel_event);
         dev->job_cancel_event = NULL;
@@ -1424,45 +3146,48 @@ device_get_select_fd (device *dev, SANE_Int *fd)
 
 
 /******************** Read machinery ********************/
+/* Forget the page, removed from the read queue. Returns true,
+ * if page was decoded ahead, and its decoded image can be used
+ */
+static bool
+device_read_queue_forget (device *dev, device_page *page)
+{
+    if (page->accounted) {
+        dev->job_images_mem -= page->data->size;
+        page->accounted = false;
+    }
+
+    return device_page_claim(page);
+}
+
 /* Purge all images from the read queue
  */
 static void
 device_read_queue_purge (device *dev)
 {
     while (dev->job_images->len > 0) {
-        http_data *p = g_ptr_array_remove_index(dev->job_images, 0);
-        http_data_unref(p);
+        device_page *page = g_ptr_array_remove_index(dev->job_images, 0);
+        device_read_queue_forget(dev, page);
+        device_page_unref(page);
     }
 }
 
-/* Push next image to reader. Returns false, if image
- * decoding cannot be started
+/* Setup image reading, when image header is available
  */
-static bool
-device_read_push (device *dev)
+static error
+device_read_start (device *dev)
 {
-    error           err;
     size_t          line_capacity;
     SANE_Parameters params;
-    image_decoder   *decoder = dev->read_decoder_jpeg;
+    image_decoder   *decoder = dev->read_decoder;
     int             wid, hei;
-
-    dev->read_image = g_ptr_array_remove_index(dev->job_images, 0);
-
-    /* Start new image decoding */
-    err = image_decoder_begin(decoder,
-            dev->read_image->bytes, dev->read_image->size);
-
-    if (err != NULL) {
-        goto DONE;
-    }
+    error           err;
 
     /* Obtain and validate image parameters */
     image_decoder_get_params(decoder, &params);
     if (params.format != dev->opt.params.format) {
         /* This is what we cannot handle */
-        err = ERROR("Unexpected image format");
-        goto DONE;
+        return ERROR("Unexpected image format");
     }
 
     wid = params.pixels_per_line;
@@ -1479,12 +3204,21 @@ device_read_push (device *dev)
     trace_printf(dev->trace, "  color depth:    %d", params.depth);
     trace_printf(dev->trace, "");
 
+    /* Lineart is decoded as 8-bit grayscale and then converted */
+    dev->read_lineart = dev->opt.params.depth == 1;
+    dev->read_line_width = dev->opt.params.bytes_per_line;
+    if (dev->read_lineart) {
+        dev->read_line_width = dev->opt.params.pixels_per_line;
+    }
+
     /* Setup image clipping */
     if (dev->job_skip_x >= wid || dev->job_skip_y >= hei) {
         /* Trivial case - just skip everything */
-        dev->read_skip_lines = hei;
+        dev->read_skip_lines = 0;
         dev->read_skip_bytes = 0;
-        line_capacity = dev->opt.params.bytes_per_line;
+        dev->read_line_end = 0;
+        dev->read_line_decoded = 0;
+        line_capacity = dev->read_line_width;
     } else {
         image_window win;
         int          bpp = image_decoder_get_bytes_per_pixel(decoder);
@@ -1496,7 +3230,7 @@ device_read_push (device *dev)
 
         err = image_decoder_set_window(decoder, &win);
         if (err != NULL) {
-            goto DONE;
+            return err;
         }
 
         dev->read_skip_bytes = 0;
@@ -1509,33 +3243,140 @@ device_read_push (device *dev)
             dev->read_skip_lines = dev->job_skip_y - win.y_off;
         }
 
-        line_capacity = math_max(dev->opt.params.bytes_per_line, wid * bpp);
+        dev->read_line_end = hei - dev->job_skip_y;
+        dev->read_line_decoded = win.wid * bpp;
+        line_capacity = math_max(
+                dev->read_line_width + dev->read_skip_bytes,
+                wid * bpp);
     }
 
     /* Initialize image decoding */
-    dev->read_line_buf = g_malloc(line_capacity);
-    memset(dev->read_line_buf, 0xff, line_capacity);
-
+    dev->read_ring_stride = line_capacity;
+    dev->read_ring_cap = math_max(2, DEVICE_READ_RING_SIZE / line_capacity);
+    dev->read_ring_buf = g_malloc(line_capacity * dev->read_ring_cap);
+    memset(dev->read_ring_buf, 0xff, line_capacity * dev->read_ring_cap);
+
+    dev->read_ring_head = 0;
+    dev->read_ring_tail = 0;
+    dev->read_line_off = 0;
     dev->read_line_num = 0;
-    dev->read_line_off = dev->opt.params.bytes_per_line;
-    dev->read_line_end = hei - dev->read_skip_lines;
 
-    /* Wake up reader */
+    /* Start the worker and wake up reader */
+    dev->read_worker_stop = 0;
+    dev->read_worker_done = 0;
+    dev->read_worker_status = SANE_STATUS_GOOD;
+    pollable_reset(dev->read_worker_wakeup);
+    dev->read_worker = g_thread_new("airscan-decode", device_read_worker, dev);
+
+    dev->read_started = true;
     pollable_signal(dev->read_pollable);
 
-DONE:
+    return NULL;
+}
+
+/* Push next image to reader. Returns false, if image
+ * decoding cannot be started
+ *
+ * If image is still being received, decoding will actually
+ * start when enough data arrives (see device_read_update())
+ */
+static bool
+device_read_push (device *dev)
+{
+    error           err = NULL;
+    device_page     *page;
+    const void      *bytes;
+    size_t          size;
+
+    page = g_ptr_array_remove_index(dev->job_images, 0);
+    dev->read_page = page;
+    dev->read_started = false;
+    dev->read_loading = page == dev->job_image_loading;
+
+    /* Start new image decoding */
+    if (device_read_queue_forget(dev, page)) {
+        /* Decoded-ahead page is already downscaled */
+        dev->read_decoder = dev->read_decoder_pnm;
+        image_decoder_set_scale(dev->read_decoder, 1);
+        err = image_decoder_begin(dev->read_decoder,
+                page->raw, page->raw_size, false);
+    } else {
+        dev->read_decoder = page->png ?
+                dev->read_decoder_png : dev->read_decoder_jpeg;
+
+        image_decoder_set_scale(dev->read_decoder, page->scale);
+
+        if (page->data == NULL) {
+            err = device_page_map(page);
+        }
+
+        if (err == NULL) {
+            bytes = device_page_bytes(page, &size);
+            err = image_decoder_begin(dev->read_decoder, bytes, size,
+                    page == dev->job_image_loading);
+        }
+    }
+
+    if (err == IMAGE_DECODER_EAGAIN) {
+        err = NULL;
+    } else if (err == NULL) {
+        err = device_read_start(dev);
+    }
+
     if (err != NULL) {
         log_debug(dev, ESTRING(err));
         trace_error(dev->trace, err);
-        http_data_unref(dev->read_image);
-        dev->read_image = NULL;
+        device_page_unref(dev->read_page);
+        dev->read_page = NULL;
         device_read_queue_purge(dev);
     }
 
     return err == NULL;
 }
 
-/* Decode next image line
+/* Update image being read, when more data arrives. Returns
+ * false, if image decoding failed and job was aborted
+ *
+ * Decoder is updated under the read_lock, as the worker
+ * may decode the same page concurrently
+ */
+static bool
+device_read_update (device *dev, device_page *page, bool more)
+{
+    error err;
+
+    if (dev->read_page != page) {
+        return true;
+    }
+
+    g_rec_mutex_lock(&dev->read_lock);
+    err = image_decoder_update(dev->read_decoder,
+            page->data->bytes, page->data->size, more);
+    dev->read_loading = more;
+    g_rec_mutex_unlock(&dev->read_lock);
+
+    if (err == IMAGE_DECODER_EAGAIN && more) {
+        return true;
+    }
+
+    if (err == NULL && !dev->read_started) {
+        err = device_read_start(dev);
+    }
+
+    if (err != NULL) {
+        log_debug(dev, ESTRING(err));
+        trace_error(dev->trace, err);
+        device_job_abort(dev, SANE_STATUS_IO_ERROR);
+        return false;
+    }
+
+    pollable_signal(dev->read_worker_wakeup);
+
+    return true;
+}
+
+/* Decode next strip of image lines into the provided buffer. Called
+ * by the worker. Number of decoded lines returned via n_read
  *
  * Note, actual image size, returned by device, may be slightly different
  * from an image size, computed according to scan options and requested
@@ -1549,34 +3390,222 @@ DONE:
  * (read "xsane") doesn't allow to cancel scanning before sane_start()
  * return, it is not good from the user experience perspective.
  */
-static SANE_Status
-device_read_decode_line (device *dev)
+static error
+device_read_decode_strip (device *dev, SANE_Byte *buf, SANE_Int count,
+        SANE_Int *n_read)
 {
     const SANE_Int n = dev->read_line_num;
+    size_t         stride = dev->read_ring_stride;
+    int            got = 0;
+    error          err = NULL;
+
+    count = math_min(count, dev->opt.params.lines - n);
+
+    /* Skip top lines, if decoder didn't skip them */
+    while (err == NULL && dev->read_skip_lines > 0) {
+        err = image_decoder_read_lines(dev->read_decoder, buf, stride,
+                math_min(count, dev->read_skip_lines), &got);
+        if (err == NULL) {
+            dev->read_skip_lines -= got;
+        }
+    }
 
-    if (n == dev->opt.params.lines) {
-        return SANE_STATUS_EOF;
+    /* Decode the strip */
+    if (err == NULL) {
+        if (n >= dev->read_line_end) {
+            SANE_Int i;
+
+            for (i = 0; i < count; i ++) {
+                memset(buf + i * stride + dev->read_skip_bytes, 0xff,
+                        dev->read_line_width);
+            }
+
+            got = count;
+        } else {
+            count = math_min(count, dev->read_line_end - n);
+            err = image_decoder_read_lines(dev->read_decoder,
+                    buf, stride, count, &got);
+        }
     }
 
-    if (n < dev->read_skip_lines || n >= dev->read_line_end) {
-        memset(dev->read_line_buf, 0xff, dev->opt.params.bytes_per_line);
-    } else {
-        error err = image_decoder_read_line(dev->read_decoder_jpeg,
-                dev->read_line_buf);
+    if (err != NULL) {
+        got = 0;
+    }
 
-        if (err != NULL) {
-            log_debug(dev, ESTRING(err));
-            trace_error(dev->trace, err);
-            return SANE_STATUS_IO_ERROR;
+    dev->read_line_num += got;
+    *n_read = got;
+
+    return err;
+}
+
+/* Convert strip of decoded lines in place, if needed. Called
+ * by the worker
+ */
+static void
+device_read_convert_strip (device *dev, SANE_Byte *buf, SANE_Int count)
+{
+    size_t   stride = dev->read_ring_stride;
+    SANE_Int skip = dev->read_skip_bytes;
+    SANE_Int width = dev->read_line_width;
+    SANE_Int pad = math_max(dev->read_line_decoded, skip);
+    SANE_Int i;
+
+    if (!dev->read_lineart) {
+        return;
+    }
+
+    for (i = 0; i < count; i ++) {
+        SANE_Byte *line = buf + i * stride;
+
+        /* If image is narrower than expected, the line tail
+         * is not written by decoder and may contain leftovers
+         * of previously converted lines, so refill it with white
+         */
+        if (pad < skip + width) {
+            memset(line + pad, 0xff, skip + width - pad);
         }
+
+        image_lineart_pack(line + skip, line + skip, width);
+    }
+}
+
+/* Perform a single step of the worker: wait for free space in the ring
+ * and decode next strip of lines into it
+ *
+ * While image is still being received, decoder is fed with data from
+ * the event loop thread, so decoding is performed under the per-device
+ * read_lock. The event loop mutex is not needed here, so decoding
+ * doesn't stall I/O and other devices
+ */
+static SANE_Status
+device_read_worker_step (device *dev)
+{
+    gint     head, tail, avail, pos;
+    SANE_Int got;
+    error    err;
+
+    if (g_atomic_int_get(&dev->read_worker_stop)) {
+        return SANE_STATUS_CANCELLED;
+    }
+
+    if (dev->read_line_num == dev->opt.params.lines) {
+        return SANE_STATUS_EOF;
+    }
+
+    /* Wait for free space in the ring */
+    pollable_reset(dev->read_worker_wakeup);
+
+    head = g_atomic_int_get(&dev->read_ring_head);
+    tail = dev->read_ring_tail;
+    avail = dev->read_ring_cap - (tail - head);
+
+    if (avail == 0) {
+        pollable_wait(dev->read_worker_wakeup);
+        return SANE_STATUS_GOOD;
+    }
+
+    /* Decode next strip */
+    pos = tail % dev->read_ring_cap;
+    avail = math_min(avail, dev->read_ring_cap - pos);
+
+    g_rec_mutex_lock(&dev->read_lock);
+    err = device_read_decode_strip(dev,
+            dev->read_ring_buf + pos * dev->read_ring_stride, avail, &got);
+
+    if (err == IMAGE_DECODER_EAGAIN && dev->read_loading) {
+        /* Wait for more data. Note, wakeup is reset under the
+         * lock, so we will not miss device_read_update() signal
+         */
+        pollable_reset(dev->read_worker_wakeup);
+        g_rec_mutex_unlock(&dev->read_lock);
+        pollable_wait(dev->read_worker_wakeup);
+        return SANE_STATUS_GOOD;
+    }
+
+    g_rec_mutex_unlock(&dev->read_lock);
+
+    if (err != NULL) {
+        /* Never taken while holding read_lock, as the event
+         * loop thread acquires these locks in the opposite order
+         */
+        eloop_mutex_lock();
+        log_debug(dev, ESTRING(err));
+        trace_error(dev->trace, err);
+        eloop_mutex_unlock();
+
+        return SANE_STATUS_IO_ERROR;
     }
 
-    dev->read_line_off = dev->read_skip_bytes;
-    dev->read_line_num ++;
+    device_read_convert_strip(dev,
+            dev->read_ring_buf + pos * dev->read_ring_stride, got);
+
+    /* Publish decoded lines */
+    g_atomic_int_set(&dev->read_ring_tail, tail + got);
+    pollable_signal(dev->read_pollable);
 
     return SANE_STATUS_GOOD;
 }
 
+/* The worker thread. Decodes image in background, filling
+ * the ring of decoded lines, consumed by device_read()
+ */
+static gpointer
+device_read_worker (gpointer data)
+{
+    device      *dev = data;
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    while (status == SANE_STATUS_GOOD) {
+        status = device_read_worker_step(dev);
+    }
+
+    dev->read_worker_status = status;
+    g_atomic_int_set(&dev->read_worker_done, 1);
+    pollable_signal(dev->read_pollable);
+
+    return NULL;
+}
+
+/* Stop the worker, if running. Called with the event loop
+ * mutex held, which is temporary released while waiting for
+ * the worker termination
+ */
+static void
+device_read_worker_stop (device *dev)
+{
+    if (dev->read_worker != NULL) {
+        g_atomic_int_set(&dev->read_worker_stop, 1);
+        pollable_signal(dev->read_worker_wakeup);
+
+        eloop_mutex_unlock();
+        g_thread_join(dev->read_worker);
+        eloop_mutex_lock();
+
+        dev->read_worker = NULL;
+    }
+}
+
+/* Finish image reading and release all associated resources
+ */
+static void
+device_read_finish (device *dev)
+{
+    device_read_worker_stop(dev);
+
+    dev->flags &= ~DEVICE_SCANNING;
+    if (dev->read_page != NULL) {
+        image_decoder_reset(dev->read_decoder);
+        device_page_unref(dev->read_page);
+        dev->read_page = NULL;
+    }
+    g_free(dev->read_ring_buf);
+    dev->read_ring_buf = NULL;
+
+    if (dev->state == DEVICE_SCAN_DONE && dev->job_images->len == 0) {
+        device_state_set(dev, DEVICE_SCAN_IDLE);
+    }
+}
+
 /* Read scanned image
  */
 SANE_Status
@@ -1598,7 +3627,10 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
     }
 
     /* Wait until device is ready */
-    while (dev->read_image == NULL && dev->state != DEVICE_SCAN_DONE) {
+    while ((dev->read_page == NULL || !dev->read_started) &&
+           dev->state != DEVICE_SCAN_DONE) {
+        pollable_reset(dev->read_pollable);
+
         if (dev->read_non_blocking) {
             *len_out = 0;
             return SANE_STATUS_GOOD;
@@ -1614,24 +3646,77 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
         goto DONE;
     }
 
-    if (dev->read_image == NULL) {
+    if (dev->read_page == NULL || !dev->read_started) {
         status = dev->job_status;
         log_assert(dev, status != SANE_STATUS_GOOD);
         goto DONE;
     }
 
-    /* Read line by line */
+    /* Copy decoded lines from the ring */
     for (len = 0; status == SANE_STATUS_GOOD && len < max_len; ) {
-        if (dev->read_line_off == dev->opt.params.bytes_per_line) {
-            status = device_read_decode_line (dev);
+        SANE_Int  bpl = dev->opt.params.bytes_per_line;
+        gint      head = dev->read_ring_head;
+        gint      done = g_atomic_int_get(&dev->read_worker_done);
+        gint      avail = g_atomic_int_get(&dev->read_ring_tail) - head;
+        SANE_Int  slot, sz;
+        SANE_Byte *src;
+
+        if (avail == 0) {
+            if (done) {
+                status = dev->read_worker_status;
+                break;
+            }
+
+            /* Wait for more lines, unless we already
+             * have something to return. Note, we need
+             * to recheck the ring after pollable reset
+             */
+            pollable_reset(dev->read_pollable);
+            if (g_atomic_int_get(&dev->read_ring_tail) != head ||
+                g_atomic_int_get(&dev->read_worker_done)) {
+                continue;
+            }
+
+            if (len > 0 || dev->read_non_blocking) {
+                break;
+            }
+
+            eloop_mutex_unlock();
+            pollable_wait(dev->read_pollable);
+            eloop_mutex_lock();
+
+            if (dev->job_status == SANE_STATUS_CANCELLED) {
+                status = SANE_STATUS_CANCELLED;
+            }
+
+            continue;
+        }
+
+        slot = head % dev->read_ring_cap;
+        src = dev->read_ring_buf + slot * dev->read_ring_stride +
+                dev->read_skip_bytes + dev->read_line_off;
+
+        /* If lines are not padded, contiguous lines are copied at once */
+        if (dev->read_ring_stride == (size_t) bpl) {
+            sz = math_min(avail, dev->read_ring_cap - slot) * bpl;
+            sz -= dev->read_line_off;
         } else {
-            SANE_Int sz = math_min(max_len - len,
-                dev->opt.params.bytes_per_line - dev->read_line_off);
+            sz = bpl - dev->read_line_off;
+        }
 
-            memcpy(data, dev->read_line_buf + dev->read_line_off, sz);
-            data += sz;
-            dev->read_line_off += sz;
-            len += sz;
+        sz = math_min(max_len - len, sz);
+
+        memcpy(data, src, sz);
+        data += sz;
+        len += sz;
+
+        /* Release consumed lines to the worker */
+        dev->read_line_off += sz;
+        if (dev->read_line_off >= bpl) {
+            g_atomic_int_set(&dev->read_ring_head,
+                    head + dev->read_line_off / bpl);
+            dev->read_line_off %= bpl;
+            pollable_signal(dev->read_worker_wakeup);
         }
     }
 
@@ -1652,18 +3737,7 @@ DONE:
     }
 
     /* Scan and read finished - cleanup device */
-    dev->flags &= ~DEVICE_SCANNING;
-    image_decoder_reset(dev->read_decoder_jpeg);
-    if (dev->read_image != NULL) {
-        http_data_unref(dev->read_image);
-        dev->read_image = NULL;
-    }
-    g_free(dev->read_line_buf);
-    dev->read_line_buf = NULL;
-
-    if (dev->state == DEVICE_SCAN_DONE && dev->job_images->len == 0) {
-        device_state_set(dev, DEVICE_SCAN_IDLE);
-    }
+    device_read_finish(dev);
 
     return status;
 }
@@ -1715,8 +3789,26 @@ device_event_init_scan_finished (void)
 SANE_Status
 device_management_init (void)
 {
+    unsigned int i;
+
     g_cond_init(&device_table_cond);
     device_table = g_ptr_array_new();
+    device_table_index = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < G_N_ELEMENTS(device_table_buckets); i ++) {
+        device_table_buckets[i].devices = g_ptr_array_new();
+    }
+
+    image_lineart_init();
+
+    if (conf.decode_ahead != 0) {
+        device_decode_ahead_pool = g_thread_pool_new(device_decode_ahead_task,
+                NULL, g_get_num_processors(), FALSE, NULL);
+    }
+
+    if (conf.spool_memory != 0) {
+        device_spool_pool = g_thread_pool_new(
+                device_escl_load_page_spool_task, NULL, 1, FALSE, NULL);
+    }
 
     eloop_add_start_stop_callback(device_management_start_stop);
 
@@ -1729,10 +3821,30 @@ void
 device_management_cleanup (void)
 {
     if (device_table != NULL) {
+        unsigned int i;
+
         log_assert(NULL, device_table->len == 0);
         g_cond_clear(&device_table_cond);
         g_ptr_array_unref(device_table);
         device_table = NULL;
+
+        g_hash_table_unref(device_table_index);
+        device_table_index = NULL;
+
+        for (i = 0; i < G_N_ELEMENTS(device_table_buckets); i ++) {
+            g_ptr_array_unref(device_table_buckets[i].devices);
+            device_table_buckets[i].devices = NULL;
+        }
+    }
+
+    if (device_decode_ahead_pool != NULL) {
+        g_thread_pool_free(device_decode_ahead_pool, FALSE, TRUE);
+        device_decode_ahead_pool = NULL;
+    }
+
+    if (device_spool_pool != NULL) {
+        g_thread_pool_free(device_spool_pool, FALSE, TRUE);
+        device_spool_pool = NULL;
     }
 }
 
@@ -11,6 +11,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Image downscaling factors, supported by image decoders
+ */
+static const int devopt_scales[] = {1, 2, 4, 8};
+
 /* Initialize device options
  */
 void
@@ -20,6 +24,9 @@ devopt_init (devopt *opt)
     opt->src = OPT_SOURCE_UNKNOWN;
     opt->colormode = OPT_COLORMODE_UNKNOWN;
     opt->resolution = CONFIG_DEFAULT_RESOLUTION;
+    sane_word_array_init(&opt->resolutions);
+    opt->scan_resolution = CONFIG_DEFAULT_RESOLUTION;
+    opt->scale = 1;
 }
 
 /* Cleanup device options
@@ -28,6 +35,83 @@ void
 devopt_cleanup (devopt *opt)
 {
     devcaps_cleanup(&opt->caps);
+    sane_word_array_cleanup(&opt->resolutions);
+}
+
+/* Get minimal resolution, supported by device
+ */
+static SANE_Word
+devopt_min_resolution (devopt *opt)
+{
+    devcaps_source *src = opt->caps.src[opt->src];
+
+    if (src->flags & DEVCAPS_SOURCE_RES_DISCRETE) {
+        return src->resolutions[1];
+    }
+
+    return src->res_range.min;
+}
+
+/* Check if resolution is supported by device
+ */
+static bool
+devopt_resolution_supported (devopt *opt, SANE_Word res)
+{
+    devcaps_source *src = opt->caps.src[opt->src];
+
+    if (src->flags & DEVCAPS_SOURCE_RES_DISCRETE) {
+        size_t i, end = sane_word_array_len(&src->resolutions) + 1;
+
+        for (i = 1; i < end; i ++) {
+            if (src->resolutions[i] == res) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    return math_range_fit(&src->res_range, res) == res;
+}
+
+/* Rebuild resolutions, offered to frontend. In addition to
+ * resolutions, supported by device, resolutions below the device
+ * minimum are offered, which are obtained by image downscaling
+ *
+ * For resolutions range it is only possible, if range is not
+ * quantized (otherwise lowering its minimum would shift all the
+ * steps) and wide enough, so every resolution below the minimum,
+ * multiplied by some scale factor, falls into the device range
+ */
+static void
+devopt_rebuild_resolutions (devopt *opt)
+{
+    devcaps_source *src = opt->caps.src[opt->src];
+    SANE_Word      min = devopt_min_resolution(opt);
+    size_t         i, end;
+
+    if (src->flags & DEVCAPS_SOURCE_RES_DISCRETE) {
+        sane_word_array_reset(&opt->resolutions);
+
+        for (i = G_N_ELEMENTS(devopt_scales) - 1; i > 0; i --) {
+            if (min % devopt_scales[i] == 0) {
+                sane_word_array_append(&opt->resolutions,
+                        min / devopt_scales[i]);
+            }
+        }
+
+        end = sane_word_array_len(&src->resolutions) + 1;
+        for (i = 1; i < end; i ++) {
+            sane_word_array_append(&opt->resolutions, src->resolutions[i]);
+        }
+    } else {
+        int scale = devopt_scales[G_N_ELEMENTS(devopt_scales) - 1];
+
+        opt->res_range = src->res_range;
+        if (src->res_range.quant <= 1 && src->res_range.max >= 2 * min - 1) {
+            opt->res_range.min = (min + scale - 1) / scale;
+        }
+    }
 }
 
 /* Choose default source
@@ -83,12 +167,12 @@ devopt_choose_resolution (devopt *opt, SANE_Word wanted)
     devcaps_source *src = opt->caps.src[opt->src];
 
     if (src->flags & DEVCAPS_SOURCE_RES_DISCRETE) {
-        SANE_Word res = src->resolutions[1];
+        SANE_Word res = opt->resolutions[1];
         SANE_Word delta = (SANE_Word) labs(wanted - res);
-        size_t i, end = sane_word_array_len(&src->resolutions) + 1;
+        size_t i, end = sane_word_array_len(&opt->resolutions) + 1;
 
         for (i = 2; i < end; i ++) {
-            SANE_Word res2 = src->resolutions[i];
+            SANE_Word res2 = opt->resolutions[i];
             SANE_Word delta2 = (SANE_Word) labs(wanted - res2);
 
             if (delta2 <= delta) {
@@ -99,7 +183,7 @@ devopt_choose_resolution (devopt *opt, SANE_Word wanted)
 
         return res;
     } else {
-        return math_range_fit(&src->res_range, wanted);
+        return math_range_fit(&opt->res_range, wanted);
     }
 }
 
@@ -141,10 +225,10 @@ devopt_rebuild_opt_desc (devopt *opt)
     desc->unit = SANE_UNIT_DPI;
     if ((src->flags & DEVCAPS_SOURCE_RES_DISCRETE) != 0) {
         desc->constraint_type = SANE_CONSTRAINT_WORD_LIST;
-        desc->constraint.word_list = src->resolutions;
+        desc->constraint.word_list = opt->resolutions;
     } else {
         desc->constraint_type = SANE_CONSTRAINT_RANGE;
-        desc->constraint.range = &src->res_range;
+        desc->constraint.range = &opt->res_range;
     }
 
     /* OPT_SCAN_MODE */
@@ -169,6 +253,15 @@ devopt_rebuild_opt_desc (devopt *opt)
     desc->constraint_type = SANE_CONSTRAINT_STRING_LIST;
     desc->constraint.string_list = (SANE_String_Const*) opt->caps.sane_sources;
 
+    /* OPT_PREVIEW */
+    desc = &opt->desc[OPT_PREVIEW];
+    desc->name = SANE_NAME_PREVIEW;
+    desc->title = SANE_TITLE_PREVIEW;
+    desc->desc = SANE_DESC_PREVIEW;
+    desc->type = SANE_TYPE_BOOL;
+    desc->size = sizeof(SANE_Word);
+    desc->cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT;
+
     /* OPT_GROUP_GEOMETRY */
     desc = &opt->desc[OPT_GROUP_GEOMETRY];
     desc->name = SANE_NAME_GEOMETRY;
@@ -226,6 +319,54 @@ devopt_rebuild_opt_desc (devopt *opt)
     desc->constraint.range = &src->win_y_range_mm;
 }
 
+/* Choose resolution, requested from device, and image downscaling
+ * factor
+ *
+ * If resolution is below the device minimum, image is scanned
+ * at the higher resolution and downscaled. In preview mode, image
+ * is scanned at the device minimum and downscaled as much as
+ * possible, but not below CONFIG_PREVIEW_RESOLUTION
+ */
+static void
+devopt_update_scale (devopt *opt)
+{
+    SANE_Word res = opt->resolution;
+    size_t    i;
+
+    if (opt->preview) {
+        SANE_Word min = devopt_min_resolution(opt);
+        SANE_Word preview = min;
+
+        for (i = G_N_ELEMENTS(devopt_scales) - 1; i > 0; i --) {
+            int scale = devopt_scales[i];
+
+            if (min % scale == 0 &&
+                min / scale >= CONFIG_PREVIEW_RESOLUTION) {
+                preview = min / scale;
+                break;
+            }
+        }
+
+        res = math_min(res, preview);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(devopt_scales); i ++) {
+        int scale = devopt_scales[i];
+
+        if (devopt_resolution_supported(opt, res * scale)) {
+            opt->scan_resolution = res * scale;
+            opt->scale = scale;
+            return;
+        }
+    }
+
+    /* May happen with resolutions range, if range quantization
+     * doesn't allow to get the exact resolution
+     */
+    opt->scan_resolution = devopt_min_resolution(opt);
+    opt->scale = 1;
+}
+
 /* Update scan parameters, according to the currently set
  * scan options
  */
@@ -234,10 +375,14 @@ devopt_update_params (devopt *opt)
 {
     SANE_Fixed wid = math_max(0, opt->br_x - opt->tl_x);
     SANE_Fixed hei = math_max(0, opt->br_y - opt->tl_y);
+    SANE_Word  res;
+
+    devopt_update_scale(opt);
+    res = opt->scan_resolution / opt->scale;
 
     opt->params.last_frame = SANE_TRUE;
-    opt->params.pixels_per_line = math_mm2px_res(wid, opt->resolution);
-    opt->params.lines = math_mm2px_res(hei, opt->resolution);
+    opt->params.pixels_per_line = math_mm2px_res(wid, res);
+    opt->params.lines = math_mm2px_res(hei, res);
 
     switch (opt->colormode) {
     case OPT_COLORMODE_COLOR:
@@ -255,8 +400,7 @@ devopt_update_params (devopt *opt)
     case OPT_COLORMODE_LINEART:
         opt->params.format = SANE_FRAME_GRAY;
         opt->params.depth = 1;
-        opt->params.bytes_per_line =
-                ((opt->params.pixels_per_line + 7) / 8) * 8;
+        opt->params.bytes_per_line = (opt->params.pixels_per_line + 7) / 8;
         break;
 
     default:
@@ -320,6 +464,7 @@ devopt_set_source (devopt *opt, OPT_SOURCE opt_src, SANE_Word *info)
     }
 
     opt->src = opt_src;
+    devopt_rebuild_resolutions(opt);
 
     /* Try to preserve current color mode */
     opt->colormode = devopt_choose_colormode(opt, opt->colormode);
@@ -339,6 +484,21 @@ devopt_set_source (devopt *opt, OPT_SOURCE opt_src, SANE_Word *info)
     return SANE_STATUS_GOOD;
 }
 
+/* Set preview mode
+ */
+static SANE_Status
+devopt_set_preview (devopt *opt, SANE_Bool preview, SANE_Word *info)
+{
+    if (opt->preview == (preview != SANE_FALSE)) {
+        return SANE_STATUS_GOOD;
+    }
+
+    opt->preview = preview != SANE_FALSE;
+    *info |= SANE_INFO_RELOAD_PARAMS;
+
+    return SANE_STATUS_GOOD;
+}
+
 /* Set geometry option
  */
 static SANE_Status
@@ -403,6 +563,7 @@ devopt_import_caps (devopt *opt, const char *xml_text, size_t xml_len)
     }
 
     opt->src = devopt_choose_default_source(opt);
+    devopt_rebuild_resolutions(opt);
     opt->colormode = devopt_choose_colormode(opt, OPT_COLORMODE_UNKNOWN);
     opt->resolution = devopt_choose_resolution(opt, CONFIG_DEFAULT_RESOLUTION);
 
@@ -459,6 +620,10 @@ devopt_set_option (devopt *opt, SANE_Int option, void *value, SANE_Word *info)
         }
         break;
 
+    case OPT_PREVIEW:
+        status = devopt_set_preview(opt, *(SANE_Bool*)value, info);
+        break;
+
     case OPT_SCAN_TL_X:
     case OPT_SCAN_TL_Y:
     case OPT_SCAN_BR_X:
@@ -506,6 +671,10 @@ devopt_get_option (devopt *opt, SANE_Int option, void *value)
         strcpy(value, opt_source_to_sane(opt->src));
         break;
 
+    case OPT_PREVIEW:
+        *(SANE_Bool*) value = opt->preview;
+        break;
+
     case OPT_SCAN_TL_X:
         *(SANE_Fixed*) value = opt->tl_x;
         break;
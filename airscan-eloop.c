@@ -191,10 +191,19 @@ eloop_new_avahi_poll (void)
  */
 void
 eloop_call (GSourceFunc func, gpointer data)
+{
+    eloop_call_full(func, data, NULL);
+}
+
+/* Call function on a context of event loop thread, with
+ * destroy notification
+ */
+void
+eloop_call_full (GSourceFunc func, gpointer data, GDestroyNotify destroy)
 {
     GSource *source = g_idle_source_new ();
     g_source_set_priority(source, G_PRIORITY_DEFAULT);
-    g_source_set_callback(source, func, data, NULL);
+    g_source_set_callback(source, func, data, destroy);
     g_source_attach(source, eloop_glib_main_context);
     g_source_unref(source);
 }
@@ -333,6 +342,103 @@ eloop_timer_cancel (eloop_timer *timer)
     g_free(timer);
 }
 
+/* File descriptor poller
+ */
+struct eloop_fdpoll {
+    GSource           source;        /* Underlying GSource */
+    int               fd;            /* File descriptor */
+    gpointer          tag;           /* Tag of fd in the GSource */
+    ELOOP_FDPOLL_MASK mask;          /* Requested events */
+    void              (*callback)(   /* User-defined callback */
+        int fd, void *data, ELOOP_FDPOLL_MASK mask);
+    void              *data;         /* Callback's argument */
+};
+
+/* eloop_fdpoll source dispatch function
+ */
+static gboolean
+eloop_fdpoll_source_dispatch (GSource *source, GSourceFunc callback,
+    gpointer data)
+{
+    eloop_fdpoll      *fdpoll = (eloop_fdpoll*) source;
+    GIOCondition      cond = g_source_query_unix_fd(source, fdpoll->tag);
+    ELOOP_FDPOLL_MASK mask = 0;
+
+    (void) callback;
+    (void) data;
+
+    if ((cond & (G_IO_ERR | G_IO_HUP)) != 0) {
+        mask = fdpoll->mask;
+    } else {
+        if ((cond & G_IO_IN) != 0) {
+            mask |= ELOOP_FDPOLL_READ;
+        }
+        if ((cond & G_IO_OUT) != 0) {
+            mask |= ELOOP_FDPOLL_WRITE;
+        }
+        mask &= fdpoll->mask;
+    }
+
+    if (mask != 0) {
+        fdpoll->callback(fdpoll->fd, fdpoll->data, mask);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Create new file descriptor poller. Initial mask is empty
+ */
+eloop_fdpoll*
+eloop_fdpoll_new (int fd,
+        void (*callback)(int fd, void *data, ELOOP_FDPOLL_MASK mask),
+        void *data)
+{
+    eloop_fdpoll        *fdpoll;
+    static GSourceFuncs funcs = {
+        .dispatch = eloop_fdpoll_source_dispatch,
+    };
+
+    fdpoll = (eloop_fdpoll*) g_source_new(&funcs, sizeof(eloop_fdpoll));
+    fdpoll->fd = fd;
+    fdpoll->callback = callback;
+    fdpoll->data = data;
+    fdpoll->tag = g_source_add_unix_fd(&fdpoll->source, fd, 0);
+
+    g_source_attach(&fdpoll->source, eloop_glib_main_context);
+
+    return fdpoll;
+}
+
+/* Destroy file descriptor poller
+ */
+void
+eloop_fdpoll_free (eloop_fdpoll *fdpoll)
+{
+    g_source_destroy(&fdpoll->source);
+    g_source_unref(&fdpoll->source);
+}
+
+/* Set event mask. Returns previous mask
+ */
+ELOOP_FDPOLL_MASK
+eloop_fdpoll_set_mask (eloop_fdpoll *fdpoll, ELOOP_FDPOLL_MASK mask)
+{
+    ELOOP_FDPOLL_MASK old = fdpoll->mask;
+    GIOCondition      cond = 0;
+
+    if ((mask & ELOOP_FDPOLL_READ) != 0) {
+        cond |= G_IO_IN;
+    }
+    if ((mask & ELOOP_FDPOLL_WRITE) != 0) {
+        cond |= G_IO_OUT;
+    }
+
+    fdpoll->mask = mask;
+    g_source_modify_unix_fd(&fdpoll->source, fdpoll->tag, cond);
+
+    return old;
+}
+
 /* Format error string, as printf() does and save result
  * in the memory, owned by the event loop
  *
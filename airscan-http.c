@@ -9,15 +9,61 @@
 #include "airscan.h"
 
 #include <libsoup/soup.h>
+
+#include <errno.h>
+#include <netdb.h>
 #include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/******************** Constants ********************/
+/* Max amount of memory, preallocated for response body,
+ * based on Content-Length
+ */
+#define HTTP_DATA_PREALLOC_MAX  (256 * 1024 * 1024)
+
+/* Max length of HTTP response line (status line, header or
+ * chunk size), for the native HTTP client
+ */
+#define HTTP_NATIVE_LINE_MAX    65536
+
+/* Size of receive buffer of the native HTTP client
+ */
+#define HTTP_NATIVE_RECV_SIZE   65536
+
+/* Max number of idle persistent connections, kept by the
+ * native HTTP client
+ */
+#define HTTP_NATIVE_IDLE_MAX    8
+
+/* Max number of connections, opened by libsoup to all hosts
+ */
+#define HTTP_SESSION_MAX_CONNS  64
+
+/* Idle persistent connections are closed by libsoup after
+ * this timeout, in seconds
+ */
+#define HTTP_SESSION_IDLE_TIMEOUT       60
+
+/******************** Types ********************/
+/* Connection of the native HTTP client
+ */
+typedef struct http_conn http_conn;
 
 /******************** Static variables ********************/
 static SoupSession *http_session;
 static http_query  *http_query_list;
+static http_conn   *http_conn_idle;
 
 /******************** Forward declarations ********************/
+static bool
+http_native_start (http_query *q);
+
 static void
-http_query_cancel (http_query *q);
+http_conn_free (http_conn *conn);
 
 /******************** HTTP URI ********************/
 /* Type http_uri represents HTTP URI
@@ -132,16 +178,33 @@ typedef struct {
     http_data     data;   /* HTTP data */
     volatile gint refcnt; /* Reference counter */
     SoupBuffer    *buf;   /* Underlying SoupBuffer */
+    GByteArray    *arr;   /* Or incrementally received data */
 } http_data_ex;
 
-/* Create http_data
+/* Create http_data from the request body
+ *
+ * If body consists of a single chunk, which is always true for
+ * request bodies we create, data is shared with the body without
+ * copying. soup_message_body_flatten() is only used as a fallback
  */
 static http_data*
 http_data_new (SoupMessageBody *body)
 {
     http_data_ex *data_ex = g_new0(http_data_ex, 1);
 
-    data_ex->buf = soup_message_body_flatten(body);
+    if (body->length > 0) {
+        data_ex->buf = soup_message_body_get_chunk(body, 0);
+        if (data_ex->buf != NULL &&
+            data_ex->buf->length != (gsize) body->length) {
+            soup_buffer_free(data_ex->buf);
+            data_ex->buf = NULL;
+        }
+    }
+
+    if (data_ex->buf == NULL) {
+        data_ex->buf = soup_message_body_flatten(body);
+    }
+
     data_ex->refcnt = 1;
     data_ex->data.bytes = data_ex->buf->data;
     data_ex->data.size = data_ex->buf->length;
@@ -149,6 +212,39 @@ http_data_new (SoupMessageBody *body)
     return &data_ex->data;
 }
 
+/* Create empty http_data, that will grow incrementally. If
+ * expected size is known, memory is preallocated, so data will
+ * not be moved, as it grows
+ */
+static http_data*
+http_data_new_growing (size_t size_hint)
+{
+    http_data_ex *data_ex = g_new0(http_data_ex, 1);
+
+    if (size_hint > HTTP_DATA_PREALLOC_MAX) {
+        size_hint = HTTP_DATA_PREALLOC_MAX;
+    }
+
+    data_ex->arr = g_byte_array_sized_new(size_hint);
+    data_ex->refcnt = 1;
+    data_ex->data.bytes = data_ex->arr->data;
+    data_ex->data.size = data_ex->arr->len;
+
+    return &data_ex->data;
+}
+
+/* Append bytes to the growing http_data
+ */
+static void
+http_data_append (http_data *data, const void *bytes, size_t size)
+{
+    http_data_ex *data_ex = OUTER_STRUCT(data, http_data_ex, data);
+
+    g_byte_array_append(data_ex->arr, bytes, size);
+    data_ex->data.bytes = data_ex->arr->data;
+    data_ex->data.size = data_ex->arr->len;
+}
+
 /* Ref http_data
  */
 http_data*
@@ -167,7 +263,11 @@ http_data_unref (http_data *data)
     if (data != NULL) {
         http_data_ex *data_ex = OUTER_STRUCT(data, http_data_ex, data);
         if (g_atomic_int_dec_and_test(&data_ex->refcnt)) {
-            soup_buffer_free(data_ex->buf);
+            if (data_ex->arr != NULL) {
+                g_byte_array_free(data_ex->arr, TRUE);
+            } else {
+                soup_buffer_free(data_ex->buf);
+            }
             g_free(data_ex);
         }
     }
@@ -178,9 +278,10 @@ http_data_unref (http_data *data)
  */
 struct http_client {
     void       *dev;       /* Device that owns the client */
-    http_query *query;     /* Current http_query, if any */
+    http_query *queries;   /* List of pending queries */
     void       (*onerror)( /* Callback to be called on transport error */
-            device *dev, error err);
+            device *dev, http_query *q, error err);
+    bool       keepalive;  /* Use persistent connections */
 };
 
 /* Create new http_client
@@ -190,6 +291,7 @@ http_client_new (device *dev)
 {
     http_client *client = g_new0(http_client, 1);
     client->dev = dev;
+    client->keepalive = true;
     return client;
 }
 
@@ -198,7 +300,7 @@ http_client_new (device *dev)
 void
 http_client_free (http_client *client)
 {
-    log_assert(client->dev, client->query == NULL);
+    log_assert(client->dev, client->queries == NULL);
     g_free(client);
 }
 
@@ -208,22 +310,37 @@ http_client_free (http_client *client)
  */
 void
 http_client_onerror (http_client *client,
-        void (*callback)(device *dev, error err))
+        void (*callback)(device *dev, http_query *q, error err))
 {
     client->onerror = callback;
 }
 
-/* Cancel pending http_query, if any
+/* Enable or disable persistent connections
+ */
+void
+http_client_keepalive (http_client *client, bool enable)
+{
+    client->keepalive = enable;
+}
+
+/* Cancel all pending queries, if any
  */
 void
 http_client_cancel (http_client *client)
 {
-    if (client->query) {
-        http_query_cancel(client->query);
-        client->query = NULL;
+    while (client->queries != NULL) {
+        http_query_cancel(client->queries);
     }
 }
 
+/* Check if client has pending queries
+ */
+bool
+http_client_has_pending (const http_client *client)
+{
+    return client->queries != NULL;
+}
+
 /******************** HTTP request handling ********************/
 /* Type http_query represents HTTP query (both request and response)
  */
@@ -233,9 +350,21 @@ struct http_query {
     SoupMessage *msg;              /* Underlying SOUP message */
     void (*callback) (device *dev, /* Completion callback */
             http_query *q);
+    void (*onrxdata) (device *dev, /* Incremental receive callback */
+            http_query *q);
+    void (*onrxhdr) (device *dev,  /* Response headers callback */
+            http_query *q);
     http_data   *request_data;     /* Response data, cached */
     http_data   *response_data;    /* Response data, cached */
+    GRecMutex   *rxlock;           /* Held while response data changes */
+    size_t      rxprealloc;        /* Max. preallocation for response */
     http_query  *prev, *next;      /* Prev/next query in http_query_list */
+    http_query  *client_prev,      /* Prev/next query in client->queries */
+                *client_next;
+    bool        completing;        /* Completion callback in progress */
+    bool        native;            /* Handled by native HTTP client */
+    bool        native_retry;      /* Already retried on new connection */
+    http_conn   *conn;             /* Native connection, if any */
 };
 
 /* Insert http_query into http_query_list
@@ -268,47 +397,104 @@ http_query_list_del (http_query *q)
     }
 }
 
+/* Insert http_query into list of client's pending queries
+ */
+static inline void
+http_query_client_ins (http_query *q)
+{
+    http_client *client = q->client;
+
+    if (client->queries != NULL) {
+        q->client_next = client->queries;
+        client->queries->client_prev = q;
+    }
+
+    client->queries = q;
+}
+
+/* Delete http_query from list of client's pending queries.
+ * It is safe to call this function multiple times
+ */
+static inline void
+http_query_client_del (http_query *q)
+{
+    http_client *client = q->client;
+
+    if (q->client_next != NULL) {
+        q->client_next->client_prev = q->client_prev;
+    }
+
+    if (q->client_prev != NULL) {
+        q->client_prev->client_next = q->client_next;
+    } else if (client->queries == q) {
+        client->queries = q->client_next;
+    }
+
+    q->client_prev = q->client_next = NULL;
+}
+
 /* Free http_query
  */
 static void
 http_query_free (http_query *q)
 {
     http_query_list_del(q);
+    http_query_client_del(q);
+
+    if (q->native) {
+        if (q->conn != NULL) {
+            http_conn_free(q->conn);
+        }
+        g_object_unref(q->msg);
+    }
+
     http_uri_free(q->uri);
     http_data_unref(q->request_data);
     http_data_unref(q->response_data);
     g_free(q);
 }
 
-/* soup_session_queue_message callback
+/* Complete the query: call its callback and free it
  */
 static void
-http_query_callback (SoupSession *session, SoupMessage *msg, gpointer userdata)
+http_query_complete (http_query *q)
 {
-    http_query *q = userdata;
+    device *dev = q->client->dev;
+    error  err = http_query_transport_error(q);
 
-    (void) session;
+    /* Query is not pending anymore, so http_client_cancel(),
+     * called from the callback, will not touch it, and
+     * http_query_cancel() will leave it to us
+     */
+    http_query_client_del(q);
+    q->completing = true;
 
-    if (msg->status_code != SOUP_STATUS_CANCELLED) {
-        device *dev = q->client->dev;
-        error  err = http_query_transport_error(q);
+    log_debug(dev, "HTTP %s %s: %s", q->msg->method,
+            http_uri_str(q->uri),
+            soup_status_get_phrase(q->msg->status_code));
 
-        log_assert(q->client->dev, q->client->query == q);
-        q->client->query = NULL;
+    trace_http_query_hook(device_trace(dev), q);
 
-        log_debug(dev, "HTTP %s %s: %s", q->msg->method,
-                http_uri_str(q->uri),
-                soup_status_get_phrase(msg->status_code));
+    if (err != NULL && q->client->onerror != NULL) {
+        q->client->onerror(dev, q, err);
+    } else if (q->callback != NULL) {
+        q->callback(dev, q);
+    }
 
-        trace_http_query_hook(device_trace(dev), q);
+    http_query_free(q);
+}
 
-        if (err != NULL && q->client->onerror != NULL) {
-            q->client->onerror(dev, err);
-        } else if (q->callback != NULL) {
-            q->callback(dev, q);
-        }
+/* soup_session_queue_message callback
+ */
+static void
+http_query_callback (SoupSession *session, SoupMessage *msg, gpointer userdata)
+{
+    http_query *q = userdata;
 
-        http_query_free(q);
+    (void) session;
+
+    if (msg->status_code != SOUP_STATUS_CANCELLED) {
+        http_query_complete(q);
     }
 }
 
@@ -331,6 +517,91 @@ http_query_set_host (http_query *q)
     soup_message_headers_append(q->msg->request_headers, "Host", buf);
 }
 
+/* Handle received response headers. Allocates buffer for the
+ * response body, preallocating it if Content-Length is known.
+ * If message is restarted (i.e., due to redirect), previously
+ * received body is dropped
+ */
+static void
+http_query_rx_headers (http_query *q)
+{
+    goffset len = soup_message_headers_get_content_length(
+            q->msg->response_headers);
+
+    /* Content-Length is only trusted within the limit, set by
+     * the query owner
+     */
+    if (len < 0) {
+        len = 0;
+    } else if ((guint64) len > (guint64) q->rxprealloc) {
+        len = (goffset) q->rxprealloc;
+    }
+
+    if (q->rxlock != NULL) {
+        g_rec_mutex_lock(q->rxlock);
+    }
+
+    http_data_unref(q->response_data);
+    q->response_data = http_data_new_growing((size_t) len);
+
+    if (q->rxlock != NULL) {
+        g_rec_mutex_unlock(q->rxlock);
+    }
+
+    if (q->onrxhdr != NULL) {
+        q->onrxhdr(q->client->dev, q);
+    }
+}
+
+/* Handle received portion of response body
+ *
+ * If rxlock is set, it is held across both data append and
+ * onrxdata callback, so other thread never sees the data buffer
+ * being reallocated, until callback has a chance to catch up.
+ * Note, callback may free the query
+ */
+static void
+http_query_rx_data (http_query *q, const void *data, size_t size)
+{
+    GRecMutex *rxlock = q->rxlock;
+
+    if (rxlock != NULL) {
+        g_rec_mutex_lock(rxlock);
+    }
+
+    if (q->response_data == NULL) {
+        q->response_data = http_data_new_growing(0);
+    }
+
+    http_data_append(q->response_data, data, size);
+
+    if (q->onrxdata != NULL) {
+        q->onrxdata(q->client->dev, q);
+    }
+
+    if (rxlock != NULL) {
+        g_rec_mutex_unlock(rxlock);
+    }
+}
+
+/* "got-headers" signal handler
+ */
+static void
+http_query_got_headers (SoupMessage *msg, gpointer userdata)
+{
+    (void) msg;
+    http_query_rx_headers(userdata);
+}
+
+/* "got-chunk" signal handler
+ */
+static void
+http_query_got_chunk (SoupMessage *msg, SoupBuffer *chunk, gpointer userdata)
+{
+    (void) msg;
+    http_query_rx_data(userdata, chunk->data, chunk->length);
+}
+
 /* Create new http_query
  *
  * Newly created http_query takes ownership on uri and body (if not NULL).
@@ -338,6 +609,10 @@ http_query_set_host (http_query *q)
  *
  * When query is finished, callback will be called. After return from
  * callback, memory, owned by http_query will be invalidated
+ *
+ * Multiple queries may be pending on the same http_client at the
+ * same time. They are executed concurrently, and each of them can
+ * be cancelled individually
  */
 http_query*
 http_query_new (http_client *client, http_uri *uri, const char *method,
@@ -346,10 +621,9 @@ http_query_new (http_client *client, http_uri *uri, const char *method,
 {
     http_query *q = g_new0(http_query, 1);
 
-    log_assert(client->dev, client->query == NULL);
-    client->query = q;
-
     q->client = client;
+    http_query_client_ins(q);
+
     q->uri = uri;
     q->msg = soup_message_new_from_uri(method, uri->parsed);
 
@@ -363,36 +637,64 @@ http_query_new (http_client *client, http_uri *uri, const char *method,
     /* Build and set Host: header */
     http_query_set_host(q);
 
-    /* Note, on Kyocera ECOSYS M2040dn connection keep-alive causes
-     * scanned job to remain in "Processing" state about 10 seconds
-     * after job has been actually completed, making scanner effectively
-     * busy.
-     *
-     * Looks like Kyocera firmware bug. Force connection to close
-     * as a workaround
+    /* Some devices misbehave with persistent connections,
+     * see device quirks in airscan-device.c
      */
-    soup_message_headers_append(q->msg->request_headers, "Connection", "close");
+    if (!client->keepalive) {
+        soup_message_headers_append(q->msg->request_headers,
+                "Connection", "close");
+    }
+
     q->callback = callback;
 
     log_debug(client->dev, "HTTP %s %s", q->msg->method, http_uri_str(q->uri));
 
+    /* Use native HTTP client, if enabled and possible */
+    if (conf.http_native && http_native_start(q)) {
+        return q;
+    }
+
+    /* Response body is accumulated by ourselves, directly into
+     * http_data, so don't let libsoup to keep a second copy and
+     * then flatten it
+     */
+    soup_message_body_set_accumulate(q->msg->response_body, FALSE);
+    g_signal_connect(q->msg, "got-headers",
+            G_CALLBACK(http_query_got_headers), q);
+    g_signal_connect(q->msg, "got-chunk",
+            G_CALLBACK(http_query_got_chunk), q);
+
     soup_session_queue_message(http_session, q->msg, http_query_callback, q);
 
     return q;
 }
 
 /* Cancel unfinished http_query. Callback will not be called and
- * memory owned by the http_query will be released
+ * memory owned by the http_query will be released. Other queries
+ * of the same http_client are not affected
  */
 void
 http_query_cancel (http_query *q)
 {
+    /* Query being completed is released by http_query_complete() */
+    if (q->completing) {
+        return;
+    }
+
+    /* Native queries are simply freed, with their connections */
+    if (q->native) {
+        http_query_free(q);
+        return;
+    }
+
     /* Note, if message processing already finished,
      * soup_session_cancel_message() will do literally nothing,
      * and in particular will not update message status,
      * but we rely on a fact that status of cancelled
      * messages is set properly
      */
+    g_signal_handlers_disconnect_by_data(q->msg, q);
+
     g_object_ref(q->msg);
     soup_session_cancel_message(http_session, q->msg, SOUP_STATUS_CANCELLED);
     soup_message_set_status(q->msg, SOUP_STATUS_CANCELLED);
@@ -401,6 +703,44 @@ http_query_cancel (http_query *q)
     http_query_free(q);
 }
 
+/* Set callback to be called when the next portion of
+ * response data is received
+ */
+void
+http_query_onrxdata (http_query *q, void (*callback)(device *dev, http_query *q))
+{
+    log_assert(q->client->dev, q->onrxdata == NULL);
+    q->onrxdata = callback;
+}
+
+/* Allow to preallocate up to max bytes for response data, if
+ * server announces its size with Content-Length
+ */
+void
+http_query_rxprealloc (http_query *q, size_t max)
+{
+    q->rxprealloc = max;
+}
+
+/* Set lock, held while response data is being modified and while
+ * onrxdata callback is called. It allows other thread to read the
+ * response data while it is being received
+ */
+void
+http_query_rxlock (http_query *q, GRecMutex *lock)
+{
+    q->rxlock = lock;
+}
+
+/* Set callback to be called when response headers are received
+ */
+void
+http_query_onrxhdr (http_query *q, void (*callback)(device *dev, http_query *q))
+{
+    log_assert(q->client->dev, q->onrxhdr == NULL);
+    q->onrxhdr = callback;
+}
+
 /* Get query error, if any
  *
  * Both transport errors and erroneous HTTP response codes
@@ -501,7 +841,7 @@ http_data*
 http_query_get_response_data (http_query *q)
 {
     if (q->response_data == NULL) {
-        q->response_data = http_data_new(q->msg->response_body);
+        q->response_data = http_data_new_growing(0);
     }
 
     return q->response_data;
@@ -527,6 +867,846 @@ http_query_foreach_response_header (http_query *q,
     soup_message_headers_foreach(q->msg->response_headers, callback, ptr);
 }
 
+/******************** Native HTTP client ********************/
+/* The native HTTP/1.1 client runs directly on top of the event
+ * loop, using non-blocking sockets. SoupMessage is still used as
+ * a container of request and response headers and status, so the
+ * rest of code doesn't care which client has executed the query.
+ *
+ * Only plain http:// URIs with numeric host addresses (this is
+ * what device discovery yields) are handled natively, other queries
+ * are passed to libsoup. Socket I/O goes via the http_io operations,
+ * so TLS can be plugged in later without touching the protocol code
+ */
+
+/* Connection I/O operations
+ */
+typedef struct {
+    ssize_t (*recv) (http_conn *conn, void *buf, size_t len);
+    ssize_t (*send) (http_conn *conn, const void *buf, size_t len);
+    void    (*close) (http_conn *conn);
+} http_io;
+
+/* Response parser state
+ */
+typedef enum {
+    HTTP_CONN_STATUS,       /* Waiting for status line */
+    HTTP_CONN_HEADERS,      /* Receiving headers */
+    HTTP_CONN_BODY,         /* Receiving body of known length */
+    HTTP_CONN_BODY_EOF,     /* Receiving body until EOF */
+    HTTP_CONN_CHUNK_SIZE,   /* Waiting for chunk size */
+    HTTP_CONN_CHUNK_DATA,   /* Receiving chunk data */
+    HTTP_CONN_CHUNK_END,    /* Waiting for CRLF after chunk data */
+    HTTP_CONN_TRAILER,      /* Receiving trailer */
+    HTTP_CONN_DONE          /* Response is complete */
+} HTTP_CONN_STATE;
+
+/* Native HTTP client connection
+ */
+struct http_conn {
+    char            *key;       /* "host:port", for connection reuse */
+    int             fd;         /* Socket, -1 if connect failed */
+    int             fd_err;     /* errno of failed connect */
+    eloop_fdpoll    *fdpoll;    /* Socket poller */
+    eloop_timer     *timer;     /* Deferred connect error reporting */
+    const http_io   *io;        /* I/O operations */
+    http_query      *q;         /* Current query, NULL if idle */
+    bool            connected;  /* Connection is established */
+    bool            reused;     /* Connection is taken from idle pool */
+    bool            busy;       /* We are inside of connection callback */
+    bool            dead;       /* Must be freed, when not busy */
+    GString         *wbuf;      /* Request being sent */
+    size_t          woff;       /* Count of already sent bytes */
+    GByteArray      *rbuf;      /* Received data */
+    size_t          roff;       /* Count of already parsed bytes */
+    bool            rx_any;     /* Some response bytes received */
+    HTTP_CONN_STATE state;      /* Response parser state */
+    bool            http11;     /* Server talks HTTP/1.1 */
+    bool            keepalive;  /* Connection can be reused */
+    int             status;     /* HTTP status */
+    char            *reason;    /* HTTP reason phrase */
+    guint64         remaining;  /* Remaining bytes of body or chunk */
+    http_conn       *next;      /* Next idle connection */
+};
+
+/* Plain TCP recv operation
+ */
+static ssize_t
+http_io_plain_recv (http_conn *conn, void *buf, size_t len)
+{
+    return recv(conn->fd, buf, len, 0);
+}
+
+/* Plain TCP send operation
+ */
+static ssize_t
+http_io_plain_send (http_conn *conn, const void *buf, size_t len)
+{
+    return send(conn->fd, buf, len, MSG_NOSIGNAL);
+}
+
+/* Plain TCP close operation. Socket itself is closed by
+ * http_conn_free(), so nothing to do here
+ */
+static void
+http_io_plain_close (http_conn *conn)
+{
+    (void) conn;
+}
+
+/* Plain TCP I/O operations
+ */
+static const http_io http_io_plain = {
+    http_io_plain_recv,
+    http_io_plain_send,
+    http_io_plain_close
+};
+
+/* Free the connection. If called from inside of the connection
+ * callback, connection is only marked as dead and actually freed
+ * on return from the callback
+ */
+static void
+http_conn_free (http_conn *conn)
+{
+    if (conn->busy) {
+        conn->dead = true;
+        conn->q = NULL;
+        return;
+    }
+
+    if (conn->timer != NULL) {
+        eloop_timer_cancel(conn->timer);
+    }
+
+    if (conn->fdpoll != NULL) {
+        eloop_fdpoll_free(conn->fdpoll);
+    }
+
+    if (conn->fd >= 0) {
+        conn->io->close(conn);
+        close(conn->fd);
+    }
+
+    g_free(conn->key);
+    g_free(conn->reason);
+    g_string_free(conn->wbuf, TRUE);
+    g_byte_array_free(conn->rbuf, TRUE);
+    g_free(conn);
+}
+
+/* Remove connection from the idle pool
+ */
+static void
+http_conn_idle_del (http_conn *conn)
+{
+    http_conn **pp;
+
+    for (pp = &http_conn_idle; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == conn) {
+            *pp = conn->next;
+            conn->next = NULL;
+            return;
+        }
+    }
+}
+
+/* Add connection to the idle pool. If pool is full, the
+ * oldest connection is closed
+ */
+static void
+http_conn_idle_add (http_conn *conn)
+{
+    http_conn **pp;
+    int       cnt = 1;
+
+    conn->next = http_conn_idle;
+    http_conn_idle = conn;
+
+    for (pp = &conn->next; *pp != NULL; pp = &(*pp)->next) {
+        if (++ cnt > HTTP_NATIVE_IDLE_MAX) {
+            http_conn *old = *pp;
+            *pp = NULL;
+            http_conn_free(old);
+            break;
+        }
+    }
+
+    /* Idle connection is watched for readability, so if server
+     * closes it, we will notice it and close it as well
+     */
+    eloop_fdpoll_set_mask(conn->fdpoll, ELOOP_FDPOLL_READ);
+}
+
+/* Take idle connection to the specified host:port from
+ * the pool. Returns NULL, if there is no such connection
+ */
+static http_conn*
+http_conn_idle_take (const char *key)
+{
+    http_conn *conn;
+
+    for (conn = http_conn_idle; conn != NULL; conn = conn->next) {
+        if (!strcmp(conn->key, key)) {
+            http_conn_idle_del(conn);
+            conn->reused = true;
+            return conn;
+        }
+    }
+
+    return NULL;
+}
+
+/* Make connection key for the query's URI
+ */
+static char*
+http_conn_key (http_query *q)
+{
+    SoupURI *uri = q->uri->parsed;
+    return g_strdup_printf("%s:%u", uri->host, uri->port);
+}
+
+/* Build request header line
+ */
+static void
+http_conn_build_header (const char *name, const char *value, gpointer ptr)
+{
+    g_string_append_printf(ptr, "%s: %s\r\n", name, value);
+}
+
+/* Build HTTP request for the query
+ */
+static void
+http_conn_build_request (http_conn *conn, http_query *q)
+{
+    SoupURI   *uri = q->uri->parsed;
+    http_data *body = http_query_get_request_data(q);
+
+    if (body->size != 0 ||
+        !strcmp(q->msg->method, "POST") || !strcmp(q->msg->method, "PUT")) {
+        char len[32];
+        sprintf(len, "%zu", body->size);
+        soup_message_headers_replace(q->msg->request_headers,
+                "Content-Length", len);
+    }
+
+    g_string_truncate(conn->wbuf, 0);
+    g_string_append_printf(conn->wbuf, "%s %s%s%s HTTP/1.1\r\n",
+            q->msg->method, uri->path,
+            uri->query ? "?" : "", uri->query ? uri->query : "");
+
+    soup_message_headers_foreach(q->msg->request_headers,
+            http_conn_build_header, conn->wbuf);
+
+    g_string_append(conn->wbuf, "\r\n");
+    g_string_append_len(conn->wbuf, body->bytes, body->size);
+}
+
+/* Attach query to the connection and start sending request
+ */
+static void
+http_conn_attach (http_conn *conn, http_query *q)
+{
+    conn->q = q;
+    q->conn = conn;
+
+    conn->state = HTTP_CONN_STATUS;
+    conn->rx_any = false;
+    conn->keepalive = false;
+    conn->woff = 0;
+    conn->roff = 0;
+    g_byte_array_set_size(conn->rbuf, 0);
+
+    http_conn_build_request(conn, q);
+
+    if (conn->fdpoll != NULL) {
+        eloop_fdpoll_set_mask(conn->fdpoll, ELOOP_FDPOLL_WRITE);
+    }
+}
+
+/* Detach query from the connection
+ */
+static http_query*
+http_conn_detach (http_conn *conn)
+{
+    http_query *q = conn->q;
+
+    conn->q = NULL;
+    q->conn = NULL;
+
+    return q;
+}
+
+/* Forward declarations
+ */
+static void
+http_conn_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask);
+
+static void
+http_conn_timer_callback (void *data);
+
+/* Open new connection to the query's host. Returns NULL, if
+ * host address is not numeric, so connection cannot be opened
+ * without blocking DNS lookup
+ *
+ * If connect fails immediately, error is reported later from
+ * the event loop, so query callback is never called synchronously
+ */
+static http_conn*
+http_conn_open (http_query *q)
+{
+    SoupURI         *uri = q->uri->parsed;
+    struct addrinfo hints, *ai;
+    char            port[16];
+    http_conn       *conn;
+    int             rc, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    sprintf(port, "%u", uri->port);
+    if (getaddrinfo(uri->host, port, &hints, &ai) != 0) {
+        return NULL;
+    }
+
+    conn = g_new0(http_conn, 1);
+    conn->key = http_conn_key(q);
+    conn->io = &http_io_plain;
+    conn->wbuf = g_string_new(NULL);
+    conn->rbuf = g_byte_array_new();
+
+    conn->fd = socket(ai->ai_family,
+            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (conn->fd >= 0) {
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        rc = connect(conn->fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc == 0) {
+            conn->connected = true;
+        } else if (errno != EINPROGRESS) {
+            conn->fd_err = errno;
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    } else {
+        conn->fd_err = errno;
+    }
+
+    freeaddrinfo(ai);
+
+    if (conn->fd >= 0) {
+        conn->fdpoll = eloop_fdpoll_new(conn->fd,
+                http_conn_fdpoll_callback, conn);
+    } else {
+        conn->timer = eloop_timer_new(0, http_conn_timer_callback, conn);
+    }
+
+    return conn;
+}
+
+/* Check if query method is idempotent, so query may be safely
+ * repeated, if server has closed connection without response
+ */
+static bool
+http_query_idempotent (http_query *q)
+{
+    const char *method = q->msg->method;
+
+    return !strcmp(method, "GET") || !strcmp(method, "HEAD") ||
+           !strcmp(method, "DELETE");
+}
+
+/* Complete the query with error. If persistent connection was
+ * closed by server before the response has started, the query
+ * is retried once over the new connection
+ *
+ * Only idempotent queries are sent over reused connections
+ * (see http_native_start()), so only they may be retried
+ */
+static void
+http_conn_fail (http_conn *conn, guint status, const char *reason)
+{
+    bool       retry = conn->reused && !conn->rx_any;
+    http_query *q = http_conn_detach(conn);
+    http_conn  *conn2;
+
+    conn->dead = true;
+
+    if (retry && !q->native_retry && http_query_idempotent(q)) {
+        conn2 = http_conn_open(q);
+        if (conn2 != NULL) {
+            q->native_retry = true;
+            log_debug(q->client->dev, "HTTP %s %s: %s, retrying",
+                    q->msg->method, http_uri_str(q->uri), reason);
+            http_conn_attach(conn2, q);
+            return;
+        }
+    }
+
+    soup_message_set_status_full(q->msg, status, reason);
+    http_query_complete(q);
+}
+
+/* Complete the query successfully. Connection is returned
+ * to the idle pool, if possible, or closed
+ */
+static void
+http_conn_done (http_conn *conn)
+{
+    http_query *q = http_conn_detach(conn);
+
+    if (conn->keepalive && conn->roff == conn->rbuf->len) {
+        conn->roff = 0;
+        g_byte_array_set_size(conn->rbuf, 0);
+        http_conn_idle_add(conn);
+    } else {
+        conn->dead = true;
+    }
+
+    http_query_complete(q);
+}
+
+/* Get next line from the receive buffer. Line terminator is
+ * stripped. Returns NULL, if line is not complete yet
+ */
+static char*
+http_conn_getline (http_conn *conn)
+{
+    char   *beg = (char*) conn->rbuf->data + conn->roff;
+    size_t avail = conn->rbuf->len - conn->roff;
+    char   *end = memchr(beg, '\n', avail);
+
+    if (end == NULL) {
+        return NULL;
+    }
+
+    conn->roff += end - beg + 1;
+
+    *end = '\0';
+    if (end > beg && end[-1] == '\r') {
+        end[-1] = '\0';
+    }
+
+    return beg;
+}
+
+/* Parse status line. Returns false on error
+ */
+static bool
+http_conn_parse_status (http_conn *conn, const char *line)
+{
+    char *end;
+    long status;
+
+    if (strncmp(line, "HTTP/1.", 7) || !g_ascii_isdigit(line[7]) ||
+        line[8] != ' ') {
+        return false;
+    }
+
+    status = strtol(line + 9, &end, 10);
+    if (end != line + 12 || status < 100 || status > 999 ||
+        (*end != ' ' && *end != '\0')) {
+        return false;
+    }
+
+    conn->http11 = line[7] != '0';
+    conn->status = (int) status;
+    g_free(conn->reason);
+    conn->reason = g_strdup(*end ? end + 1 : "");
+
+    soup_message_headers_clear(conn->q->msg->response_headers);
+    conn->state = HTTP_CONN_HEADERS;
+
+    return true;
+}
+
+/* Parse header line. Returns false on error
+ */
+static bool
+http_conn_parse_header (http_conn *conn, char *line)
+{
+    char *value = strchr(line, ':');
+
+    /* Obsolete line folding is not supported, just ignore it */
+    if (*line == ' ' || *line == '\t') {
+        return true;
+    }
+
+    if (value == NULL || value == line) {
+        return false;
+    }
+
+    *value ++ = '\0';
+    soup_message_headers_append(conn->q->msg->response_headers,
+            g_strstrip(line), g_strstrip(value));
+
+    return true;
+}
+
+/* Handle end of response headers. Returns false on error
+ */
+static bool
+http_conn_headers_done (http_conn *conn)
+{
+    http_query         *q = conn->q;
+    SoupMessageHeaders *hdrs = q->msg->response_headers;
+    const char         *len;
+
+    /* Skip informational responses */
+    if (conn->status < 200) {
+        conn->state = HTTP_CONN_STATUS;
+        return true;
+    }
+
+    soup_message_set_status_full(q->msg, conn->status, conn->reason);
+
+    if (conn->http11) {
+        conn->keepalive = !soup_message_headers_header_contains(hdrs,
+                "Connection", "close");
+    } else {
+        conn->keepalive = soup_message_headers_header_contains(hdrs,
+                "Connection", "keep-alive");
+    }
+
+    if (soup_message_headers_header_contains(q->msg->request_headers,
+            "Connection", "close")) {
+        conn->keepalive = false;
+    }
+
+    /* Choose the way, how response body is delimited */
+    len = soup_message_headers_get_one(hdrs, "Content-Length");
+
+    if (!strcmp(q->msg->method, "HEAD") ||
+        conn->status == 204 || conn->status == 304) {
+        conn->state = HTTP_CONN_DONE;
+    } else if (soup_message_headers_header_contains(hdrs,
+            "Transfer-Encoding", "chunked")) {
+        conn->state = HTTP_CONN_CHUNK_SIZE;
+    } else if (len != NULL) {
+        char *end;
+
+        conn->remaining = g_ascii_strtoull(len, &end, 10);
+        if (end == len || *end != '\0') {
+            return false;
+        }
+
+        conn->state = conn->remaining ? HTTP_CONN_BODY : HTTP_CONN_DONE;
+    } else {
+        conn->state = HTTP_CONN_BODY_EOF;
+        conn->keepalive = false;
+    }
+
+    http_query_rx_headers(q);
+
+    return true;
+}
+
+/* Parse chunk size line. Returns false on error
+ */
+static bool
+http_conn_parse_chunk_size (http_conn *conn, const char *line)
+{
+    char *end;
+
+    conn->remaining = g_ascii_strtoull(line, &end, 16);
+    if (end == line ||
+        (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t')) {
+        return false;
+    }
+
+    conn->state = conn->remaining ? HTTP_CONN_CHUNK_DATA : HTTP_CONN_TRAILER;
+
+    return true;
+}
+
+/* Pass received body bytes to the query
+ */
+static void
+http_conn_body (http_conn *conn, size_t size)
+{
+    const uint8_t *data = conn->rbuf->data + conn->roff;
+
+    conn->roff += size;
+    http_query_rx_data(conn->q, data, size);
+}
+
+/* Parse received data. Returns false on protocol error
+ */
+static bool
+http_conn_parse (http_conn *conn)
+{
+    /* Note, query callbacks may cancel the query. In this
+     * case connection is marked as dead, and we must stop
+     */
+    while (!conn->dead) {
+        size_t avail = conn->rbuf->len - conn->roff;
+        char   *line = NULL;
+        bool   ok = true;
+
+        switch (conn->state) {
+        case HTTP_CONN_STATUS:
+        case HTTP_CONN_HEADERS:
+        case HTTP_CONN_CHUNK_SIZE:
+        case HTTP_CONN_CHUNK_END:
+        case HTTP_CONN_TRAILER:
+            line = http_conn_getline(conn);
+            if (line == NULL) {
+                return avail <= HTTP_NATIVE_LINE_MAX;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        switch (conn->state) {
+        case HTTP_CONN_STATUS:
+            ok = http_conn_parse_status(conn, line);
+            break;
+
+        case HTTP_CONN_HEADERS:
+            if (*line) {
+                ok = http_conn_parse_header(conn, line);
+            } else {
+                ok = http_conn_headers_done(conn);
+            }
+            break;
+
+        case HTTP_CONN_BODY:
+        case HTTP_CONN_CHUNK_DATA:
+            if (avail == 0) {
+                return true;
+            }
+
+            avail = (size_t) MIN((guint64) avail, conn->remaining);
+            conn->remaining -= avail;
+
+            if (conn->remaining == 0) {
+                conn->state = conn->state == HTTP_CONN_BODY ?
+                        HTTP_CONN_DONE : HTTP_CONN_CHUNK_END;
+            }
+
+            http_conn_body(conn, avail);
+            break;
+
+        case HTTP_CONN_BODY_EOF:
+            if (avail != 0) {
+                http_conn_body(conn, avail);
+            }
+            return true;
+
+        case HTTP_CONN_CHUNK_SIZE:
+            ok = http_conn_parse_chunk_size(conn, line);
+            break;
+
+        case HTTP_CONN_CHUNK_END:
+            ok = *line == '\0';
+            conn->state = HTTP_CONN_CHUNK_SIZE;
+            break;
+
+        case HTTP_CONN_TRAILER:
+            if (*line == '\0') {
+                conn->state = HTTP_CONN_DONE;
+            }
+            break;
+
+        case HTTP_CONN_DONE:
+            http_conn_done(conn);
+            return true;
+        }
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Handle socket writability
+ */
+static void
+http_conn_write (http_conn *conn)
+{
+    ssize_t rc;
+
+    if (!conn->connected) {
+        int       err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            err = errno;
+        }
+
+        if (err != 0) {
+            http_conn_fail(conn, SOUP_STATUS_CANT_CONNECT, strerror(err));
+            return;
+        }
+
+        conn->connected = true;
+    }
+
+    while (conn->woff < conn->wbuf->len) {
+        rc = conn->io->send(conn, conn->wbuf->str + conn->woff,
+                conn->wbuf->len - conn->woff);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+
+            http_conn_fail(conn, SOUP_STATUS_IO_ERROR, strerror(errno));
+            return;
+        }
+
+        conn->woff += rc;
+    }
+
+    eloop_fdpoll_set_mask(conn->fdpoll, ELOOP_FDPOLL_READ);
+}
+
+/* Handle socket readability
+ */
+static void
+http_conn_read (http_conn *conn)
+{
+    size_t  off;
+    ssize_t rc;
+
+    /* Drop already parsed data */
+    if (conn->roff != 0) {
+        g_byte_array_remove_range(conn->rbuf, 0, conn->roff);
+        conn->roff = 0;
+    }
+
+    off = conn->rbuf->len;
+    g_byte_array_set_size(conn->rbuf, off + HTTP_NATIVE_RECV_SIZE);
+    rc = conn->io->recv(conn, conn->rbuf->data + off, HTTP_NATIVE_RECV_SIZE);
+    g_byte_array_set_size(conn->rbuf, off + (rc > 0 ? rc : 0));
+
+    if (rc < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            http_conn_fail(conn, SOUP_STATUS_IO_ERROR, strerror(errno));
+        }
+        return;
+    }
+
+    if (rc == 0) {
+        if (conn->state == HTTP_CONN_BODY_EOF) {
+            http_conn_done(conn);
+        } else {
+            http_conn_fail(conn, SOUP_STATUS_IO_ERROR,
+                    "Connection closed by server");
+        }
+        return;
+    }
+
+    conn->rx_any = true;
+    if (!http_conn_parse(conn) && !conn->dead) {
+        http_conn_fail(conn, SOUP_STATUS_MALFORMED, "Malformed response");
+    }
+}
+
+/* Connection socket poller callback
+ */
+static void
+http_conn_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    http_conn *conn = data;
+
+    (void) fd;
+
+    conn->busy = true;
+
+    if (conn->q == NULL) {
+        /* Idle connection was closed by server (or server sends
+         * something unexpected, which is the same for us)
+         */
+        http_conn_idle_del(conn);
+        conn->dead = true;
+    } else if ((mask & ELOOP_FDPOLL_WRITE) != 0) {
+        http_conn_write(conn);
+    } else if ((mask & ELOOP_FDPOLL_READ) != 0) {
+        http_conn_read(conn);
+    }
+
+    conn->busy = false;
+    if (conn->dead) {
+        http_conn_free(conn);
+    }
+}
+
+/* Deferred connect error reporting timer callback
+ */
+static void
+http_conn_timer_callback (void *data)
+{
+    http_conn *conn = data;
+
+    conn->timer = NULL;
+    conn->busy = true;
+    http_conn_fail(conn, SOUP_STATUS_CANT_CONNECT, strerror(conn->fd_err));
+    conn->busy = false;
+
+    http_conn_free(conn);
+}
+
+/* Start query execution by the native HTTP client. Returns false,
+ * if query cannot be handled natively and must be passed to libsoup
+ */
+static bool
+http_native_start (http_query *q)
+{
+    char      *key;
+    http_conn *conn;
+
+    if (strcmp(q->uri->parsed->scheme, "http")) {
+        return false;
+    }
+
+    /* Non-idempotent request always goes over the new connection,
+     * as it can't be retried, if server closes idle connection
+     * at the moment, when request is being sent
+     */
+    conn = NULL;
+    if (http_query_idempotent(q)) {
+        key = http_conn_key(q);
+        conn = http_conn_idle_take(key);
+        g_free(key);
+    }
+
+    if (conn == NULL) {
+        conn = http_conn_open(q);
+    }
+
+    if (conn == NULL) {
+        return false;
+    }
+
+    q->native = true;
+    http_conn_attach(conn, q);
+
+    return true;
+}
+
+/* Close all idle connections
+ */
+static void
+http_native_cleanup (void)
+{
+    while (http_conn_idle != NULL) {
+        http_conn *conn = http_conn_idle;
+        http_conn_idle = conn->next;
+        http_conn_free(conn);
+    }
+}
+
 /******************** HTTP initialization & cleanup ********************/
 /* Start/stop HTTP client
  */
@@ -546,6 +1726,33 @@ http_start_stop (bool start)
 
         g_object_set_property(G_OBJECT(http_session),
             SOUP_SESSION_SSL_STRICT, &val);
+
+        /* TLS handshake is expensive for scanner's CPU, so connections
+         * are kept open between requests and reused as long as possible.
+         *
+         * We run up to adf_prefetch page requests, status request and
+         * background job cleanup to the same device simultaneously, so
+         * allow enough connections per host to avoid opening new ones
+         * under load. New connections to the same host resume TLS
+         * session, which is done by glib-networking by itself
+         */
+        g_value_unset(&val);
+        g_value_init(&val, G_TYPE_INT);
+
+        g_value_set_int(&val, conf.adf_prefetch + 2);
+        g_object_set_property(G_OBJECT(http_session),
+            SOUP_SESSION_MAX_CONNS_PER_HOST, &val);
+
+        g_value_set_int(&val, HTTP_SESSION_MAX_CONNS);
+        g_object_set_property(G_OBJECT(http_session),
+            SOUP_SESSION_MAX_CONNS, &val);
+
+        g_value_unset(&val);
+        g_value_init(&val, G_TYPE_UINT);
+
+        g_value_set_uint(&val, HTTP_SESSION_IDLE_TIMEOUT);
+        g_object_set_property(G_OBJECT(http_session),
+            SOUP_SESSION_IDLE_TIMEOUT, &val);
     } else {
         soup_session_abort(http_session);
         g_object_unref(http_session);
@@ -557,6 +1764,8 @@ http_start_stop (bool start)
         while (http_query_list != NULL) {
             http_query_free(http_query_list);
         }
+
+        http_native_cleanup();
     }
 }
 
@@ -12,16 +12,46 @@
 #include <setjmp.h>
 #include <string.h>
 
+/* jpeg_crop_scanline() and jpeg_skip_scanlines() first appeared
+ * in libjpeg-turbo 1.5. LIBJPEG_TURBO_VERSION_NUMBER is defined
+ * by jconfig.h since libjpeg-turbo 2.0; 1.5.x can be enabled
+ * manually by adding -DIMAGE_DECODER_JPEG_HAS_CROP=1 to CPPFLAGS
+ */
+#ifndef IMAGE_DECODER_JPEG_HAS_CROP
+#   if defined(LIBJPEG_TURBO_VERSION_NUMBER) && \
+       LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#       define IMAGE_DECODER_JPEG_HAS_CROP      1
+#   else
+#       define IMAGE_DECODER_JPEG_HAS_CROP      0
+#   endif
+#endif
+
+/* Image decoder "need more data" error
+ */
+const char image_decoder_eagain[] = "image decoder: need more data";
+
+/* Max number of lines, passed to jpeg_read_scanlines() at once
+ */
+#define IMAGE_DECODER_JPEG_MAX_LINES    16
+
 /* JPEG image decoder
  */
 typedef struct {
     image_decoder                 decoder;   /* Base class */
     struct jpeg_decompress_struct cinfo;     /* libjpeg decoder */
     struct jpeg_error_mgr         jerr;      /* libjpeg error manager */
+    struct jpeg_source_mgr        src;       /* Suspending data source */
     jmp_buf                       jmpb;      /* For longjmp from libjpeg */
     char                          errbuf[    /* Error buffer */
                                         JMSG_LENGTH_MAX + 16];
     JDIMENSION                    num_lines; /* Num of lines left to read */
+    const JOCTET                  *data;     /* Image data received so far */
+    size_t                        size;      /* Its size */
+    bool                          more;      /* More data will follow */
+    size_t                        skip;      /* Bytes to skip, when arrived */
+    bool                          header;    /* Header is parsed */
+    bool                          started;   /* Decompression is started */
+    int                           scale;     /* Downscaling factor */
 } image_decoder_jpeg;
 
 /* Free JPEG decoder
@@ -35,30 +65,134 @@ image_decoder_jpeg_free (image_decoder *decoder)
     g_free(jpeg);
 }
 
-/* Begin JPEG decoding
+/* Source manager: initialize source. Called by jpeg_read_header()
+ */
+static void
+image_decoder_jpeg_src_init (j_decompress_ptr cinfo)
+{
+    (void) cinfo;
+}
+
+/* Source manager: fill input buffer. Called by libjpeg, when
+ * all available data is consumed
+ *
+ * If more data is expected, we return FALSE, which causes libjpeg
+ * to suspend decoding until data arrives. Otherwise, we insert
+ * a fake EOI marker, as jpeg_mem_src() does, so truncated
+ * image will be decoded as much as possible
+ */
+static boolean
+image_decoder_jpeg_src_fill (j_decompress_ptr cinfo)
+{
+    image_decoder_jpeg  *jpeg = OUTER_STRUCT(cinfo, image_decoder_jpeg, cinfo);
+    static const JOCTET eoi[] = {0xff, JPEG_EOI};
+
+    if (jpeg->more) {
+        return FALSE;
+    }
+
+    jpeg->src.next_input_byte = eoi;
+    jpeg->src.bytes_in_buffer = sizeof(eoi);
+
+    return TRUE;
+}
+
+/* Source manager: skip input data. If data is not available yet,
+ * remember how many bytes to skip, when data will arrive
+ */
+static void
+image_decoder_jpeg_src_skip (j_decompress_ptr cinfo, long num_bytes)
+{
+    image_decoder_jpeg  *jpeg = OUTER_STRUCT(cinfo, image_decoder_jpeg, cinfo);
+
+    if (num_bytes <= 0) {
+        return;
+    }
+
+    if ((size_t) num_bytes <= jpeg->src.bytes_in_buffer) {
+        jpeg->src.next_input_byte += num_bytes;
+        jpeg->src.bytes_in_buffer -= num_bytes;
+    } else {
+        jpeg->skip += num_bytes - jpeg->src.bytes_in_buffer;
+        jpeg->src.next_input_byte += jpeg->src.bytes_in_buffer;
+        jpeg->src.bytes_in_buffer = 0;
+    }
+}
+
+/* Source manager: terminate source. Called by jpeg_finish_decompress()
+ */
+static void
+image_decoder_jpeg_src_term (j_decompress_ptr cinfo)
+{
+    (void) cinfo;
+}
+
+/* Set image data. The data pointer may change, as data grows,
+ * but the already consumed bytes are preserved
+ */
+static void
+image_decoder_jpeg_set_data (image_decoder_jpeg *jpeg, const void *data,
+        size_t size, bool more)
+{
+    size_t off = 0, skip;
+
+    if (jpeg->data != NULL) {
+        off = jpeg->src.next_input_byte - jpeg->data;
+    }
+
+    skip = jpeg->skip;
+    if (skip > size - off) {
+        skip = size - off;
+    }
+
+    off += skip;
+    jpeg->skip -= skip;
+
+    jpeg->data = data;
+    jpeg->size = size;
+    jpeg->more = more;
+
+    jpeg->src.next_input_byte = jpeg->data + off;
+    jpeg->src.bytes_in_buffer = size - off;
+}
+
+/* Parse JPEG header and start decompression, if not done yet.
+ * Returns IMAGE_DECODER_EAGAIN, if more data is needed
  */
 static error
-image_decoder_jpeg_begin (image_decoder *decoder, const void *data,
-        size_t size)
+image_decoder_jpeg_start (image_decoder_jpeg *jpeg)
 {
-    image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
-    int                rc;
+    int rc;
 
     if (!setjmp(jpeg->jmpb)) {
-        jpeg_mem_src(&jpeg->cinfo, (unsigned char*) data, size);
-
-        rc = jpeg_read_header(&jpeg->cinfo, true);
-        if (rc != JPEG_HEADER_OK) {
-            jpeg_abort((j_common_ptr) &jpeg->cinfo);
-            return ERROR("JPEG: invalid header");
+        if (!jpeg->header) {
+            rc = jpeg_read_header(&jpeg->cinfo, true);
+            if (rc == JPEG_SUSPENDED) {
+                return IMAGE_DECODER_EAGAIN;
+            }
+
+            if (rc != JPEG_HEADER_OK) {
+                jpeg_abort((j_common_ptr) &jpeg->cinfo);
+                return ERROR("JPEG: invalid header");
+            }
+
+            if (jpeg->cinfo.num_components != 1) {
+                jpeg->cinfo.out_color_space = JCS_RGB;
+            }
+
+            /* Downscaling is performed by IDCT, almost for free */
+            jpeg->cinfo.scale_num = 1;
+            jpeg->cinfo.scale_denom = jpeg->scale;
+
+            jpeg->header = true;
         }
 
-        if (jpeg->cinfo.num_components != 1) {
-            jpeg->cinfo.out_color_space = JCS_RGB;
+        if (!jpeg_start_decompress(&jpeg->cinfo)) {
+            return IMAGE_DECODER_EAGAIN;
         }
 
-        jpeg_start_decompress(&jpeg->cinfo);
-        jpeg->num_lines = jpeg->cinfo.image_height;
+        jpeg->started = true;
+        jpeg->num_lines = jpeg->cinfo.output_height;
 
         return NULL;
     }
@@ -66,6 +200,49 @@ image_decoder_jpeg_begin (image_decoder *decoder, const void *data,
     return ERROR(jpeg->errbuf);
 }
 
+/* Begin JPEG decoding
+ */
+static error
+image_decoder_jpeg_begin (image_decoder *decoder, const void *data,
+        size_t size, bool more)
+{
+    image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
+
+    jpeg->data = NULL;
+    jpeg->skip = 0;
+    jpeg->header = jpeg->started = false;
+    jpeg->cinfo.src = &jpeg->src;
+
+    image_decoder_jpeg_set_data(jpeg, data, size, more);
+
+    return image_decoder_jpeg_start(jpeg);
+}
+
+/* Update JPEG image data
+ */
+static error
+image_decoder_jpeg_update (image_decoder *decoder, const void *data,
+        size_t size, bool more)
+{
+    image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
+
+    /* Once we have reported end of data to libjpeg, the data
+     * source may point to the fake EOI marker, and there is
+     * nothing more to update
+     */
+    if (!jpeg->more) {
+        return NULL;
+    }
+
+    image_decoder_jpeg_set_data(jpeg, data, size, more);
+
+    if (!jpeg->started) {
+        return image_decoder_jpeg_start(jpeg);
+    }
+
+    return NULL;
+}
+
 /* Reset JPEG decoder
  */
 static void
@@ -74,6 +251,18 @@ image_decoder_jpeg_reset (image_decoder *decoder)
     image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
 
     jpeg_abort((j_common_ptr) &jpeg->cinfo);
+    jpeg->data = NULL;
+    jpeg->size = 0;
+    jpeg->more = false;
+}
+
+/* Set image downscaling factor
+ */
+static void
+image_decoder_jpeg_set_scale (image_decoder *decoder, int scale)
+{
+    image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
+    jpeg->scale = scale;
 }
 
 /* Get bytes count per pixel
@@ -93,8 +282,8 @@ image_decoder_jpeg_get_params (image_decoder *decoder, SANE_Parameters *params)
     image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
 
     params->last_frame = SANE_TRUE;
-    params->pixels_per_line = jpeg->cinfo.image_width;
-    params->lines = jpeg->cinfo.image_height;
+    params->pixels_per_line = jpeg->cinfo.output_width;
+    params->lines = jpeg->cinfo.output_height;
     params->depth = 8;
 
     if (jpeg->cinfo.num_components == 1) {
@@ -113,60 +302,106 @@ image_decoder_jpeg_set_window (image_decoder *decoder, image_window *win)
 {
     image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
 
-    /* Note, image clipping cannot be supported on rather
-     * old libjpeg version (i.e., on Ubuntu 16.04, because
-     * jpeg_crop_scanline() and jpeg_skip_scanlines() functions
-     * are missed. The safe default is to update window to
-     * match the entire image dimensions.
-     */
-
-#if     1
-    win->x_off = win->y_off = 0;
-    win->wid = jpeg->cinfo.image_width;
-    win->hei = jpeg->cinfo.image_height;
-    return NULL;
-#else
+#if     IMAGE_DECODER_JPEG_HAS_CROP
     JDIMENSION         x_off = win->x_off;
     JDIMENSION         wid = win->wid;
 
     if (!setjmp(jpeg->jmpb)) {
+        /* jpeg_crop_scanline() only adjusts decoder parameters,
+         * so it's OK to call it while image is still being received
+         */
         jpeg_crop_scanline(&jpeg->cinfo, &x_off, &wid);
-        if (win->y_off > 0) {
+        win->x_off = x_off;
+        win->wid = wid;
+
+        /* jpeg_skip_scanlines() doesn't support suspending data
+         * sources, so we only use it, if entire image is already
+         * available. Otherwise, lines will be skipped by caller
+         */
+        if (win->y_off > 0 && !jpeg->more) {
             jpeg_skip_scanlines(&jpeg->cinfo, win->y_off);
+        } else {
+            win->y_off = 0;
+            win->hei = jpeg->cinfo.output_height;
         }
 
         jpeg->num_lines = win->hei;
 
-        win->x_off = x_off;
-        win->wid = wid;
-
         return NULL;
     }
 
     return ERROR(jpeg->errbuf);
+#else
+    /* Image clipping cannot be supported on rather old
+     * libjpeg version (i.e., on Ubuntu 16.04), because
+     * jpeg_crop_scanline() and jpeg_skip_scanlines() functions
+     * are missed. The safe default is to update window to
+     * match the entire image dimensions.
+     */
+    win->x_off = win->y_off = 0;
+    win->wid = jpeg->cinfo.output_width;
+    win->hei = jpeg->cinfo.output_height;
+    return NULL;
 #endif
 }
 
-/* Read next line of image
+/* Read strip of image lines. Returns number of lines actually read
+ *
+ * libjpeg returns at most rec_outbuf_height lines per call, so
+ * we need to loop until the strip is filled
+ */
+static JDIMENSION
+image_decoder_jpeg_read_strip (image_decoder_jpeg *jpeg, void *buffer,
+        size_t stride, JDIMENSION count)
+{
+    JSAMPROW   lines[IMAGE_DECODER_JPEG_MAX_LINES];
+    JDIMENSION done = 0;
+
+    while (done < count) {
+        JDIMENSION i, n, rc;
+
+        n = math_min(count - done, IMAGE_DECODER_JPEG_MAX_LINES);
+        for (i = 0; i < n; i ++) {
+            lines[i] = (JSAMPROW) buffer + (done + i) * stride;
+        }
+
+        rc = jpeg_read_scanlines(&jpeg->cinfo, lines, n);
+        if (rc == 0) {
+            break;
+        }
+
+        done += rc;
+        jpeg->num_lines -= rc;
+    }
+
+    return done;
+}
+
+/* Read strip of image lines
  */
 static error
-image_decoder_jpeg_read_line (image_decoder *decoder, void *buffer)
+image_decoder_jpeg_read_lines (image_decoder *decoder, void *buffer,
+        size_t stride, int count, int *n_read)
 {
     image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
-    JSAMPROW           lines[1] = {buffer};
+
+    *n_read = 0;
 
     if (!jpeg->num_lines) {
         return ERROR("JPEG: end of file");
     }
 
     if (!setjmp(jpeg->jmpb)) {
-        if (jpeg_read_scanlines(&jpeg->cinfo, lines, 1) == 0) {
-            return ERROR(jpeg->errbuf);
-        }
+        *n_read = image_decoder_jpeg_read_strip(jpeg, buffer, stride,
+                math_min(count, jpeg->num_lines));
 
-        jpeg->num_lines --;
+        if (*n_read != 0) {
+            return NULL;
+        }
 
-        return NULL;
+        if (jpeg->more) {
+            return IMAGE_DECODER_EAGAIN;
+        }
     }
 
     return ERROR(jpeg->errbuf);
@@ -207,17 +442,27 @@ image_decoder_jpeg_new (void)
     jpeg->decoder.content_type = "image/jpeg";
     jpeg->decoder.free = image_decoder_jpeg_free;
     jpeg->decoder.begin = image_decoder_jpeg_begin;
+    jpeg->decoder.update = image_decoder_jpeg_update;
     jpeg->decoder.reset = image_decoder_jpeg_reset;
+    jpeg->decoder.set_scale = image_decoder_jpeg_set_scale;
     jpeg->decoder.get_bytes_per_pixel = image_decoder_jpeg_get_bytes_per_pixel;
     jpeg->decoder.get_params = image_decoder_jpeg_get_params;
     jpeg->decoder.set_window = image_decoder_jpeg_set_window;
-    jpeg->decoder.read_line = image_decoder_jpeg_read_line;
+    jpeg->decoder.read_lines = image_decoder_jpeg_read_lines;
+
+    jpeg->scale = 1;
 
     jpeg->cinfo.err = jpeg_std_error(&jpeg->jerr);
     jpeg->jerr.output_message = image_decoder_jpeg_output_message;
     jpeg->jerr.error_exit = image_decoder_jpeg_error_exit;
     jpeg_create_decompress(&jpeg->cinfo);
 
+    jpeg->src.init_source = image_decoder_jpeg_src_init;
+    jpeg->src.fill_input_buffer = image_decoder_jpeg_src_fill;
+    jpeg->src.skip_input_data = image_decoder_jpeg_src_skip;
+    jpeg->src.resync_to_restart = jpeg_resync_to_restart;
+    jpeg->src.term_source = image_decoder_jpeg_src_term;
+
     return &jpeg->decoder;
 }
 
@@ -0,0 +1,301 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Conversion of 8-bit grayscale lines into 1-bit lineart
+ */
+
+#include "airscan.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define IMAGE_LINEART_X86    1
+#   include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   define IMAGE_LINEART_NEON   1
+#   include <arm_neon.h>
+#endif
+
+/* Pixels below this value become black. Note, SSE2 and AVX2
+ * kernels rely on the threshold being exactly 128
+ */
+#define IMAGE_LINEART_THRESHOLD         128
+
+/* Size of buffer, used for throughput measurement, in pixels
+ */
+#define IMAGE_LINEART_BENCH_PIXELS      (1024 * 1024)
+
+/* Lineart packing kernel. Packs pixels, rounded down to the
+ * kernel's block size, and returns number of packed pixels
+ */
+typedef size_t (*image_lineart_kernel) (uint8_t *dst, const uint8_t *src,
+        size_t pixels);
+
+/* Pack single byte of 8 pixels. Pixel is black (bit is set),
+ * if its value is below the threshold
+ */
+static inline uint8_t
+image_lineart_pack8 (const uint8_t *src, int count)
+{
+    uint8_t byte = 0;
+    int     i;
+
+    for (i = 0; i < count; i ++) {
+        if (src[i] < IMAGE_LINEART_THRESHOLD) {
+            byte |= 0x80 >> i;
+        }
+    }
+
+    return byte;
+}
+
+/* Portable kernel
+ */
+static size_t
+image_lineart_pack_scalar (uint8_t *dst, const uint8_t *src, size_t pixels)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        *dst ++ = image_lineart_pack8(src + i, 8);
+    }
+
+    return i;
+}
+
+#ifdef IMAGE_LINEART_X86
+/* Bit-reversed bytes, for the SSE2 kernel
+ */
+static uint8_t image_lineart_reverse[256];
+
+/* SSE2 kernel. With the threshold of 128, the pixel bit is simply
+ * an inverted most significant bit of the pixel, so we extract
+ * them with movemask, 16 pixels at once. movemask puts the first
+ * pixel into the least significant bit, so bits are reversed
+ * with the lookup table
+ */
+static size_t __attribute__ ((target ("sse2")))
+image_lineart_pack_sse2 (uint8_t *dst, const uint8_t *src, size_t pixels)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= pixels; i += 16) {
+        __m128i  v = _mm_loadu_si128((const __m128i*) (src + i));
+        unsigned m = ~_mm_movemask_epi8(v);
+
+        *dst ++ = image_lineart_reverse[m & 0xff];
+        *dst ++ = image_lineart_reverse[(m >> 8) & 0xff];
+    }
+
+    return i;
+}
+
+/* AVX2 kernel. Reverses pixels within each group of 8 with
+ * byte shuffle, so movemask produces bytes in the right bit
+ * order, 32 pixels at once
+ */
+static size_t __attribute__ ((target ("avx2")))
+image_lineart_pack_avx2 (uint8_t *dst, const uint8_t *src, size_t pixels)
+{
+    const __m256i rev = _mm256_setr_epi8(
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t        i;
+
+    for (i = 0; i + 32 <= pixels; i += 32) {
+        __m256i  v = _mm256_loadu_si256((const __m256i*) (src + i));
+        uint32_t m;
+
+        v = _mm256_shuffle_epi8(v, rev);
+        m = ~(uint32_t) _mm256_movemask_epi8(v);
+
+        dst[0] = m;
+        dst[1] = m >> 8;
+        dst[2] = m >> 16;
+        dst[3] = m >> 24;
+        dst += 4;
+    }
+
+    return i;
+}
+#endif
+
+#ifdef IMAGE_LINEART_NEON
+/* NEON kernel. Compare gives 0xff for black pixels, which
+ * is masked with bit weights and horizontally added, 16 pixels
+ * at once
+ */
+static size_t
+image_lineart_pack_neon (uint8_t *dst, const uint8_t *src, size_t pixels)
+{
+    static const uint8_t weights[8] = {128, 64, 32, 16, 8, 4, 2, 1};
+    const uint8x16_t     w = vcombine_u8(vld1_u8(weights), vld1_u8(weights));
+    const uint8x16_t     t = vdupq_n_u8(IMAGE_LINEART_THRESHOLD);
+    size_t               i;
+
+    for (i = 0; i + 16 <= pixels; i += 16) {
+        uint8x16_t v = vandq_u8(vcltq_u8(vld1q_u8(src + i), t), w);
+        uint8x8_t  s = vpadd_u8(vget_low_u8(v), vget_high_u8(v));
+
+        s = vpadd_u8(s, s);
+        s = vpadd_u8(s, s);
+
+        *dst ++ = vget_lane_u8(s, 0);
+        *dst ++ = vget_lane_u8(s, 1);
+    }
+
+    return i;
+}
+#endif
+
+/* Table of available kernels, the best first
+ */
+static const struct {
+    const char           *name;   /* Kernel name */
+    image_lineart_kernel kernel;  /* Kernel function */
+} image_lineart_kernels[] = {
+#ifdef IMAGE_LINEART_X86
+    {"avx2", image_lineart_pack_avx2},
+    {"sse2", image_lineart_pack_sse2},
+#endif
+#ifdef IMAGE_LINEART_NEON
+    {"neon", image_lineart_pack_neon},
+#endif
+    {"scalar", image_lineart_pack_scalar}
+};
+
+/* Kernel in use
+ */
+static image_lineart_kernel image_lineart_kernel_current =
+        image_lineart_pack_scalar;
+
+/* Check if kernel is supported by CPU
+ */
+static bool
+image_lineart_kernel_supported (const char *name)
+{
+#ifdef IMAGE_LINEART_X86
+    __builtin_cpu_init();
+
+    if (!strcmp(name, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+
+    if (!strcmp(name, "sse2")) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+
+    (void) name;
+    return true;
+}
+
+/* Pack line with the particular kernel
+ */
+static void
+image_lineart_pack_with (image_lineart_kernel kernel, uint8_t *dst,
+        const uint8_t *src, size_t pixels)
+{
+    size_t done = kernel(dst, src, pixels);
+
+    dst += done / 8;
+    src += done;
+    pixels -= done;
+
+    done = image_lineart_pack_scalar(dst, src, pixels);
+
+    if (done != pixels) {
+        dst[done / 8] = image_lineart_pack8(src + done, pixels - done);
+    }
+}
+
+/* Measure kernel throughput, in megapixels per second
+ */
+static double
+image_lineart_bench (image_lineart_kernel kernel, uint8_t *dst,
+        const uint8_t *src)
+{
+    gint64 start = g_get_monotonic_time(), elapsed;
+    int    rounds = 0;
+
+    do {
+        image_lineart_pack_with(kernel, dst, src,
+                IMAGE_LINEART_BENCH_PIXELS);
+        rounds ++;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < 10000);
+
+    return (double) rounds * IMAGE_LINEART_BENCH_PIXELS / elapsed;
+}
+
+/* Initialize lineart conversion. Chooses the best kernel, supported
+ * by CPU. If debugging is enabled, throughput of all supported kernels
+ * is measured and logged
+ */
+void
+image_lineart_init (void)
+{
+    size_t  i, chosen = G_N_ELEMENTS(image_lineart_kernels);
+    uint8_t *src = NULL, *dst = NULL;
+
+#ifdef IMAGE_LINEART_X86
+    for (i = 0; i < 256; i ++) {
+        unsigned j;
+
+        image_lineart_reverse[i] = 0;
+        for (j = 0; j < 8; j ++) {
+            if (i & (1 << j)) {
+                image_lineart_reverse[i] |= 0x80 >> j;
+            }
+        }
+    }
+#endif
+
+    if (conf.dbg_enabled) {
+        src = g_malloc(IMAGE_LINEART_BENCH_PIXELS);
+        dst = g_malloc(IMAGE_LINEART_BENCH_PIXELS / 8);
+        for (i = 0; i < IMAGE_LINEART_BENCH_PIXELS; i ++) {
+            src[i] = (i * 37) ^ (i >> 7);
+        }
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(image_lineart_kernels); i ++) {
+        const char *name = image_lineart_kernels[i].name;
+
+        if (!image_lineart_kernel_supported(name)) {
+            continue;
+        }
+
+        if (chosen == G_N_ELEMENTS(image_lineart_kernels)) {
+            chosen = i;
+        }
+
+        if (src != NULL) {
+            log_debug(NULL, "lineart: %s kernel: %.0f Mpixels/sec", name,
+                    image_lineart_bench(image_lineart_kernels[i].kernel,
+                            dst, src));
+        }
+    }
+
+    image_lineart_kernel_current = image_lineart_kernels[chosen].kernel;
+    log_debug(NULL, "lineart: using %s kernel",
+            image_lineart_kernels[chosen].name);
+
+    g_free(src);
+    g_free(dst);
+}
+
+/* Pack line of 8-bit grayscale pixels into 1-bit lineart
+ */
+void
+image_lineart_pack (uint8_t *dst, const uint8_t *src, size_t pixels)
+{
+    image_lineart_pack_with(image_lineart_kernel_current, dst, src, pixels);
+}
+
+/* vim:ts=8:sw=4:et
+ */
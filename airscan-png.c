@@ -0,0 +1,486 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * PNG image decoder
+ */
+
+#include "airscan.h"
+
+#include <png.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Max amount of compressed data, passed to png_process_data()
+ * at once. libpng pushes decoded rows to us and cannot be stopped
+ * in the middle of the chunk, so this value limits amount of
+ * rows we need to buffer ahead of reader
+ */
+#define IMAGE_DECODER_PNG_CHUNK         1024
+
+/* PNG image decoder
+ */
+typedef struct {
+    image_decoder decoder;     /* Base class */
+    png_structp   png;         /* libpng decoder */
+    png_infop     info;        /* libpng image info */
+    char          errbuf[256]; /* Error buffer */
+    const uint8_t *data;       /* Image data received so far */
+    size_t        size;        /* Its size */
+    bool          more;        /* More data will follow */
+    size_t        off;         /* Bytes already passed to libpng */
+    bool          header;      /* Header is parsed */
+    bool          done;        /* End of image is reached */
+    bool          interlaced;  /* Image is interlaced */
+    int           scale;       /* Downscaling factor */
+    int           width;       /* Downscaled image width, in pixels */
+    int           height;      /* Downscaled image height, in pixels */
+    int           components;  /* 1 for gray, 3 for RGB */
+    size_t        bpl;         /* Bytes per decoded row */
+    uint8_t       *rows;       /* Buffer of decoded rows */
+    int           rows_cap;    /* Buffer capacity, in rows */
+    int           rows_first;  /* Index of first buffered row */
+    int           rows_count;  /* Count of buffered rows */
+    int           rows_y;      /* Image row of first buffered row */
+    image_window  win;         /* Clipping window */
+    int           line;        /* Next line to read, within window */
+} image_decoder_png;
+
+/* Destroy libpng decoder and release decoded rows
+ */
+static void
+image_decoder_png_cleanup (image_decoder_png *png)
+{
+    if (png->png != NULL) {
+        png_destroy_read_struct(&png->png, &png->info, NULL);
+    }
+
+    g_free(png->rows);
+    png->rows = NULL;
+    png->rows_cap = png->rows_first = png->rows_count = 0;
+}
+
+/* Free PNG decoder
+ */
+static void
+image_decoder_png_free (image_decoder *decoder)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+
+    image_decoder_png_cleanup(png);
+    g_free(png);
+}
+
+/* libpng callback: image header is parsed
+ *
+ * Here we setup transformations, so the output is always
+ * either 8-bit grayscale or 8-bit RGB
+ */
+static void
+image_decoder_png_info_callback (png_structp p, png_infop info)
+{
+    image_decoder_png *png = png_get_progressive_ptr(p);
+    png_uint_32       width, height;
+    int               depth, color, interlace;
+
+    png_get_IHDR(p, info, &width, &height, &depth, &color, &interlace,
+            NULL, NULL);
+
+    if (color == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(p);
+    }
+
+    if (color == PNG_COLOR_TYPE_GRAY && depth < 8) {
+        png_set_expand_gray_1_2_4_to_8(p);
+    }
+
+    if (depth == 16) {
+        png_set_strip_16(p);
+    }
+
+    /* Note, palette expansion converts tRNS chunk into
+     * alpha channel, so it needs to be stripped as well
+     */
+    if ((color & PNG_COLOR_MASK_ALPHA) != 0 ||
+        png_get_valid(p, info, PNG_INFO_tRNS) != 0) {
+        png_set_strip_alpha(p);
+    }
+
+    png->interlaced = png_set_interlace_handling(p) > 1;
+    png_read_update_info(p, info);
+
+    png->width = (width + png->scale - 1) / png->scale;
+    png->height = (height + png->scale - 1) / png->scale;
+    png->components = png_get_channels(p, info);
+    png->bpl = png_get_rowbytes(p, info);
+
+    if (png->components != 1 && png->components != 3) {
+        png_error(p, "unsupported color type");
+    }
+
+    /* Interlaced image is assembled from several passes, so we
+     * need the whole image buffer and rows become available
+     * only at the end of image
+     */
+    if (png->interlaced) {
+        png->rows = g_malloc0(png->bpl * height);
+        png->rows_cap = height;
+    }
+
+    png->win.x_off = png->win.y_off = 0;
+    png->win.wid = png->width;
+    png->win.hei = png->height;
+    png->line = 0;
+
+    png->header = true;
+}
+
+/* libpng callback: image row is decoded
+ */
+static void
+image_decoder_png_row_callback (png_structp p, png_bytep row,
+        png_uint_32 row_num, int pass)
+{
+    image_decoder_png *png = png_get_progressive_ptr(p);
+    int               end;
+
+    (void) pass;
+
+    if (png->interlaced) {
+        png_progressive_combine_row(p, png->rows + row_num * png->bpl, row);
+        return;
+    }
+
+    /* Rows, dropped by downscaling or outside of the clipping
+     * window, are not needed
+     */
+    if (row_num % png->scale != 0) {
+        return;
+    }
+
+    row_num /= png->scale;
+    if (row_num < (png_uint_32) png->win.y_off ||
+        row_num >= (png_uint_32) (png->win.y_off + png->win.hei)) {
+        return;
+    }
+
+    /* Make room for the new row */
+    end = png->rows_first + png->rows_count;
+    if (end == png->rows_cap) {
+        if (png->rows_first != 0) {
+            memmove(png->rows, png->rows + png->rows_first * png->bpl,
+                    png->rows_count * png->bpl);
+            png->rows_first = 0;
+        } else {
+            png->rows_cap = png->rows_cap ? png->rows_cap * 2 : 16;
+            png->rows = g_realloc(png->rows, png->rows_cap * png->bpl);
+        }
+
+        end = png->rows_first + png->rows_count;
+    }
+
+    if (png->rows_count == 0) {
+        png->rows_y = row_num;
+    }
+
+    memcpy(png->rows + end * png->bpl, row, png->bpl);
+    png->rows_count ++;
+}
+
+/* libpng callback: end of image is reached
+ */
+static void
+image_decoder_png_end_callback (png_structp p, png_infop info)
+{
+    image_decoder_png *png = png_get_progressive_ptr(p);
+
+    (void) info;
+
+    if (png->interlaced) {
+        png->rows_first = png->win.y_off;
+        png->rows_count = png->win.hei;
+    }
+
+    png->done = true;
+}
+
+/* libpng error callback. Default callback prints message
+ * to stderr, which is not good for us
+ */
+static void
+image_decoder_png_error_callback (png_structp p, png_const_charp msg)
+{
+    image_decoder_png *png = png_get_error_ptr(p);
+
+    snprintf(png->errbuf, sizeof(png->errbuf), "PNG: %s", msg);
+    png_longjmp(p, 1);
+}
+
+/* libpng warning callback
+ */
+static void
+image_decoder_png_warning_callback (png_structp p, png_const_charp msg)
+{
+    (void) p;
+    (void) msg;
+}
+
+/* Check if decoder has enough decoded data. If count is 0, only
+ * image header is required, otherwise count lines are required
+ */
+static bool
+image_decoder_png_ready (image_decoder_png *png, int count)
+{
+    if (!png->header) {
+        return false;
+    }
+
+    return count == 0 || png->done || png->rows_count >= count;
+}
+
+/* Pass received data to libpng, until enough data is decoded
+ */
+static error
+image_decoder_png_feed (image_decoder_png *png, int count)
+{
+    if (!setjmp(png_jmpbuf(png->png))) {
+        while (!image_decoder_png_ready(png, count) && png->off < png->size) {
+            size_t chunk = png->size - png->off;
+
+            if (chunk > IMAGE_DECODER_PNG_CHUNK) {
+                chunk = IMAGE_DECODER_PNG_CHUNK;
+            }
+
+            png_process_data(png->png, png->info,
+                    (png_bytep) png->data + png->off, chunk);
+            png->off += chunk;
+        }
+
+        return NULL;
+    }
+
+    return ERROR(png->errbuf);
+}
+
+/* Parse PNG header, if not done yet. Returns IMAGE_DECODER_EAGAIN,
+ * if more data is needed
+ */
+static error
+image_decoder_png_start (image_decoder_png *png)
+{
+    error err = image_decoder_png_feed(png, 0);
+
+    if (err == NULL && !png->header) {
+        err = png->more ? IMAGE_DECODER_EAGAIN : ERROR("PNG: truncated");
+    }
+
+    return err;
+}
+
+/* Begin PNG decoding
+ */
+static error
+image_decoder_png_begin (image_decoder *decoder, const void *data,
+        size_t size, bool more)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+
+    image_decoder_png_cleanup(png);
+
+    png->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, png,
+            image_decoder_png_error_callback,
+            image_decoder_png_warning_callback);
+    if (png->png != NULL) {
+        png->info = png_create_info_struct(png->png);
+    }
+
+    if (png->info == NULL) {
+        return ERROR("PNG: out of memory");
+    }
+
+    png_set_progressive_read_fn(png->png, png,
+            image_decoder_png_info_callback,
+            image_decoder_png_row_callback,
+            image_decoder_png_end_callback);
+
+    png->data = data;
+    png->size = size;
+    png->more = more;
+    png->off = 0;
+    png->header = png->done = false;
+
+    return image_decoder_png_start(png);
+}
+
+/* Update PNG image data. libpng keeps its own copy of partially
+ * consumed input, so data pointer may freely change, as data grows
+ */
+static error
+image_decoder_png_update (image_decoder *decoder, const void *data,
+        size_t size, bool more)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+
+    png->data = data;
+    png->size = size;
+    png->more = more;
+
+    if (!png->header) {
+        return image_decoder_png_start(png);
+    }
+
+    return NULL;
+}
+
+/* Reset PNG decoder
+ */
+static void
+image_decoder_png_reset (image_decoder *decoder)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+
+    image_decoder_png_cleanup(png);
+    png->data = NULL;
+    png->size = png->off = 0;
+    png->more = false;
+    png->header = png->done = false;
+}
+
+/* Set image downscaling factor
+ */
+static void
+image_decoder_png_set_scale (image_decoder *decoder, int scale)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+    png->scale = scale;
+}
+
+/* Get bytes count per pixel
+ */
+static int
+image_decoder_png_get_bytes_per_pixel (image_decoder *decoder)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+    return png->components;
+}
+
+/* Get image parameters
+ */
+static void
+image_decoder_png_get_params (image_decoder *decoder, SANE_Parameters *params)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+
+    params->last_frame = SANE_TRUE;
+    params->pixels_per_line = png->width;
+    params->lines = png->height;
+    params->depth = 8;
+    params->format = png->components == 1 ? SANE_FRAME_GRAY : SANE_FRAME_RGB;
+    params->bytes_per_line = png->width * png->components;
+}
+
+/* Set clipping window. PNG decoder honors exact window boundaries
+ *
+ * Some rows may be already decoded together with the image header,
+ * so rows outside of the new window are dropped here
+ */
+static error
+image_decoder_png_set_window (image_decoder *decoder, image_window *win)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+    int               skip, end;
+
+    png->win = *win;
+    png->line = 0;
+
+    if (!png->interlaced && png->rows_count != 0) {
+        skip = math_max(win->y_off - png->rows_y, 0);
+        skip = math_min(skip, png->rows_count);
+        png->rows_first += skip;
+        png->rows_count -= skip;
+        png->rows_y += skip;
+
+        end = math_max(win->y_off + win->hei - png->rows_y, 0);
+        png->rows_count = math_min(png->rows_count, end);
+    }
+
+    return NULL;
+}
+
+/* Read strip of image lines
+ */
+static error
+image_decoder_png_read_lines (image_decoder *decoder, void *buffer,
+        size_t stride, int count, int *n_read)
+{
+    image_decoder_png *png = (image_decoder_png*) decoder;
+    size_t            step = png->interlaced ? png->scale : 1;
+    error             err;
+    int               i;
+
+    *n_read = 0;
+
+    if (png->line >= png->win.hei) {
+        return ERROR("PNG: end of file");
+    }
+
+    count = math_min(count, png->win.hei - png->line);
+
+    err = image_decoder_png_feed(png, count);
+    if (err != NULL) {
+        return err;
+    }
+
+    count = math_min(count, png->rows_count);
+    for (i = 0; i < count; i ++) {
+        const uint8_t *row = png->rows +
+                (png->rows_first + i) * step * png->bpl;
+
+        image_copy_pixels((uint8_t*) buffer + i * stride, row,
+                png->components, png->win.x_off, png->win.wid, png->scale);
+    }
+
+    png->rows_first += count;
+    png->rows_count -= count;
+    png->rows_y += count;
+    png->line += count;
+
+    *n_read = count;
+
+    if (count != 0) {
+        return NULL;
+    }
+
+    if (png->more && !png->done) {
+        return IMAGE_DECODER_EAGAIN;
+    }
+
+    return ERROR("PNG: truncated");
+}
+
+/* Create PNG image decoder
+ */
+image_decoder*
+image_decoder_png_new (void)
+{
+    image_decoder_png *png = g_new0(image_decoder_png, 1);
+
+    png->decoder.content_type = "image/png";
+    png->decoder.free = image_decoder_png_free;
+    png->decoder.begin = image_decoder_png_begin;
+    png->decoder.update = image_decoder_png_update;
+    png->decoder.reset = image_decoder_png_reset;
+    png->decoder.set_scale = image_decoder_png_set_scale;
+    png->decoder.get_bytes_per_pixel = image_decoder_png_get_bytes_per_pixel;
+    png->decoder.get_params = image_decoder_png_get_params;
+    png->decoder.set_window = image_decoder_png_set_window;
+    png->decoder.read_lines = image_decoder_png_read_lines;
+
+    png->scale = 1;
+
+    return &png->decoder;
+}
+
+/* vim:ts=8:sw=4:et
+ */
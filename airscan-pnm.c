@@ -0,0 +1,298 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * PNM image decoder
+ *
+ * Scanners don't return images in this format. Instead, it is used
+ * internally to keep pages, decoded ahead of time (see airscan-device.c)
+ */
+
+#include "airscan.h"
+
+#include <string.h>
+
+/* PNM image decoder
+ */
+typedef struct {
+    image_decoder decoder;     /* Base class */
+    const uint8_t *data;       /* Image data */
+    size_t        size;        /* Its size */
+    bool          more;        /* More data will follow */
+    int           width;       /* Image width, in pixels */
+    int           height;      /* Image height, in pixels */
+    int           components;  /* 1 for P5 (gray), 3 for P6 (RGB) */
+    size_t        pixels;      /* Offset of pixels within the data */
+    int           scale;       /* Downscaling factor */
+    image_window  win;         /* Clipping window */
+    int           line;        /* Next line to read, within window */
+} image_decoder_pnm;
+
+/* Free PNM decoder
+ */
+static void
+image_decoder_pnm_free (image_decoder *decoder)
+{
+    g_free(decoder);
+}
+
+/* Parse next decimal number of the PNM header. Returns -1,
+ * if header is truncated, 0 on success, 1 on syntax error
+ */
+static int
+image_decoder_pnm_parse_num (image_decoder_pnm *pnm, size_t *off, int *num)
+{
+    const uint8_t *data = pnm->data;
+
+    /* Skip white space and comments */
+    for (;;) {
+        if (*off == pnm->size) {
+            return -1;
+        }
+
+        if (data[*off] == '#') {
+            while (*off != pnm->size && data[*off] != '\n') {
+                (*off) ++;
+            }
+        } else if (g_ascii_isspace(data[*off])) {
+            (*off) ++;
+        } else {
+            break;
+        }
+    }
+
+    /* Parse the number */
+    if (!g_ascii_isdigit(data[*off])) {
+        return 1;
+    }
+
+    *num = 0;
+    while (*off != pnm->size && g_ascii_isdigit(data[*off])) {
+        if (*num > 0xffff) {
+            return 1;
+        }
+        *num = *num * 10 + data[*off] - '0';
+        (*off) ++;
+    }
+
+    /* Number must be followed by single white space */
+    if (*off == pnm->size) {
+        return -1;
+    }
+
+    if (!g_ascii_isspace(data[*off])) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Parse PNM header
+ */
+static error
+image_decoder_pnm_parse_header (image_decoder_pnm *pnm)
+{
+    size_t off = 2;
+    int    maxval, rc;
+
+    if (pnm->size < 2) {
+        return pnm->more ? IMAGE_DECODER_EAGAIN : ERROR("PNM: truncated");
+    }
+
+    if (pnm->data[0] != 'P' ||
+        (pnm->data[1] != '5' && pnm->data[1] != '6')) {
+        return ERROR("PNM: unsupported format");
+    }
+
+    pnm->components = pnm->data[1] == '5' ? 1 : 3;
+
+    rc = image_decoder_pnm_parse_num(pnm, &off, &pnm->width);
+    if (rc == 0) {
+        rc = image_decoder_pnm_parse_num(pnm, &off, &pnm->height);
+    }
+    if (rc == 0) {
+        rc = image_decoder_pnm_parse_num(pnm, &off, &maxval);
+    }
+
+    if (rc < 0) {
+        return pnm->more ? IMAGE_DECODER_EAGAIN : ERROR("PNM: truncated");
+    }
+
+    if (rc > 0 || pnm->width == 0 || pnm->height == 0) {
+        return ERROR("PNM: invalid header");
+    }
+
+    if (maxval != 255) {
+        return ERROR("PNM: unsupported color depth");
+    }
+
+    pnm->pixels = off + 1;
+    pnm->win.x_off = pnm->win.y_off = 0;
+    pnm->win.wid = (pnm->width + pnm->scale - 1) / pnm->scale;
+    pnm->win.hei = (pnm->height + pnm->scale - 1) / pnm->scale;
+    pnm->line = 0;
+
+    return NULL;
+}
+
+/* Begin PNM decoding
+ */
+static error
+image_decoder_pnm_begin (image_decoder *decoder, const void *data,
+        size_t size, bool more)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+
+    pnm->data = data;
+    pnm->size = size;
+    pnm->more = more;
+    pnm->pixels = 0;
+
+    return image_decoder_pnm_parse_header(pnm);
+}
+
+/* Update PNM image data
+ */
+static error
+image_decoder_pnm_update (image_decoder *decoder, const void *data,
+        size_t size, bool more)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+
+    pnm->data = data;
+    pnm->size = size;
+    pnm->more = more;
+
+    if (pnm->pixels == 0) {
+        return image_decoder_pnm_parse_header(pnm);
+    }
+
+    return NULL;
+}
+
+/* Reset PNM decoder
+ */
+static void
+image_decoder_pnm_reset (image_decoder *decoder)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+
+    pnm->data = NULL;
+    pnm->size = 0;
+    pnm->more = false;
+    pnm->pixels = 0;
+}
+
+/* Set image downscaling factor
+ */
+static void
+image_decoder_pnm_set_scale (image_decoder *decoder, int scale)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+    pnm->scale = scale;
+}
+
+/* Get bytes count per pixel
+ */
+static int
+image_decoder_pnm_get_bytes_per_pixel (image_decoder *decoder)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+    return pnm->components;
+}
+
+/* Get image parameters
+ */
+static void
+image_decoder_pnm_get_params (image_decoder *decoder, SANE_Parameters *params)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+
+    params->last_frame = SANE_TRUE;
+    params->pixels_per_line = (pnm->width + pnm->scale - 1) / pnm->scale;
+    params->lines = (pnm->height + pnm->scale - 1) / pnm->scale;
+    params->depth = 8;
+    params->format = pnm->components == 1 ? SANE_FRAME_GRAY : SANE_FRAME_RGB;
+    params->bytes_per_line = params->pixels_per_line * pnm->components;
+}
+
+/* Set clipping window. PNM decoder honors exact window boundaries
+ */
+static error
+image_decoder_pnm_set_window (image_decoder *decoder, image_window *win)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+
+    pnm->win = *win;
+    pnm->line = 0;
+
+    return NULL;
+}
+
+/* Read strip of image lines
+ */
+static error
+image_decoder_pnm_read_lines (image_decoder *decoder, void *buffer,
+        size_t stride, int count, int *n_read)
+{
+    image_decoder_pnm *pnm = (image_decoder_pnm*) decoder;
+    size_t            bpl = (size_t) pnm->width * pnm->components;
+    int               i;
+
+    *n_read = 0;
+
+    if (pnm->line >= pnm->win.hei) {
+        return ERROR("PNM: end of file");
+    }
+
+    count = math_min(count, pnm->win.hei - pnm->line);
+
+    for (i = 0; i < count; i ++) {
+        size_t off = pnm->pixels +
+                (size_t) (pnm->win.y_off + pnm->line) * pnm->scale * bpl;
+
+        if (off + bpl > pnm->size) {
+            break;
+        }
+
+        image_copy_pixels((uint8_t*) buffer + i * stride,
+                pnm->data + off, pnm->components,
+                pnm->win.x_off, pnm->win.wid, pnm->scale);
+        pnm->line ++;
+    }
+
+    *n_read = i;
+
+    if (i != 0) {
+        return NULL;
+    }
+
+    return pnm->more ? IMAGE_DECODER_EAGAIN : ERROR("PNM: truncated");
+}
+
+/* Create PNM image decoder
+ */
+image_decoder*
+image_decoder_pnm_new (void)
+{
+    image_decoder_pnm *pnm = g_new0(image_decoder_pnm, 1);
+
+    pnm->decoder.content_type = "image/x-portable-anymap";
+    pnm->decoder.free = image_decoder_pnm_free;
+    pnm->decoder.begin = image_decoder_pnm_begin;
+    pnm->decoder.update = image_decoder_pnm_update;
+    pnm->decoder.reset = image_decoder_pnm_reset;
+    pnm->decoder.set_scale = image_decoder_pnm_set_scale;
+    pnm->decoder.get_bytes_per_pixel = image_decoder_pnm_get_bytes_per_pixel;
+    pnm->decoder.get_params = image_decoder_pnm_get_params;
+    pnm->decoder.set_window = image_decoder_pnm_set_window;
+    pnm->decoder.read_lines = image_decoder_pnm_read_lines;
+
+    pnm->scale = 1;
+
+    return &pnm->decoder;
+}
+
+/* vim:ts=8:sw=4:et
+ */
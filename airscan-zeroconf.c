@@ -186,14 +186,32 @@ zeroconf_devstate_del_all (bool notify)
     }
 }
 
+/* Get value of the TXT record key. Returns NULL, if key
+ * is not found or its value is empty
+ */
+static const char*
+zeroconf_txt_get (AvahiStringList *txt, const char *key)
+{
+    AvahiStringList *rec = avahi_string_list_find(txt, key);
+    size_t          len = strlen(key) + 1;
+
+    if (rec == NULL || rec->size <= len) {
+        return NULL;
+    }
+
+    return (const char*) (rec->text + len);
+}
+
 /* Create new zeroconf_addrinfo
  */
 static zeroconf_addrinfo*
-zeroconf_addrinfo_new (const AvahiAddress *addr, uint16_t port, const char *rs,
-        AvahiIfIndex interface)
+zeroconf_addrinfo_new (const AvahiAddress *addr, uint16_t port,
+        AvahiStringList *txt, AvahiIfIndex interface)
 {
     zeroconf_addrinfo *addrinfo = g_new0(zeroconf_addrinfo, 1);
     char              str_addr[128];
+    const char        *rs = zeroconf_txt_get(txt, "rs");
+    const char        *model = zeroconf_txt_get(txt, "mdl");
     int               rs_len;
 
     if (addr->proto == AVAHI_PROTO_INET) {
@@ -253,6 +271,15 @@ zeroconf_addrinfo_new (const AvahiAddress *addr, uint16_t port, const char *rs,
                 rs_len, rs);
     }
 
+    /* Save device identification */
+    if (model == NULL) {
+        model = zeroconf_txt_get(txt, "ty");
+    }
+
+    addrinfo->uuid = g_strdup(zeroconf_txt_get(txt, "uuid"));
+    addrinfo->vendor = g_strdup(zeroconf_txt_get(txt, "mfg"));
+    addrinfo->model = g_strdup(model);
+
     return addrinfo;
 }
 
@@ -265,6 +292,9 @@ zeroconf_addrinfo_copy_single (const zeroconf_addrinfo *addrinfo)
 
     *addrinfo2 = *addrinfo;
     addrinfo2->uri = g_strdup(addrinfo->uri);
+    addrinfo2->uuid = g_strdup(addrinfo->uuid);
+    addrinfo2->vendor = g_strdup(addrinfo->vendor);
+    addrinfo2->model = g_strdup(addrinfo->model);
     addrinfo2->next = NULL;
 
     return addrinfo2;
@@ -277,6 +307,9 @@ static void
 zeroconf_addrinfo_free_single (zeroconf_addrinfo *addrinfo)
 {
     g_free((char*) addrinfo->uri);
+    g_free((char*) addrinfo->uuid);
+    g_free((char*) addrinfo->vendor);
+    g_free((char*) addrinfo->model);
     g_free(addrinfo);
 }
 
@@ -456,18 +489,11 @@ zeroconf_avahi_resolver_callback (AvahiServiceResolver *r,
 
     zeroconf_devstate *devstate = userdata;
     zeroconf_addrinfo *addrinfo;
-    AvahiStringList   *rs;
-    const char        *rs_text = NULL;
 
     /* Handle event */
     switch (event) {
     case AVAHI_RESOLVER_FOUND:
-        rs = avahi_string_list_find(txt, "rs");
-        if (rs != NULL && rs->size > 3) {
-            rs_text = (char*) (rs->text + 3);
-        }
-
-        addrinfo = zeroconf_addrinfo_new(addr, port, rs_text, interface);
+        addrinfo = zeroconf_addrinfo_new(addr, port, txt, interface);
         zeroconf_addrinfo_list_prepend(&devstate->addresses, addrinfo);
         break;
 
@@ -17,6 +17,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 /******************** Static configuration ********************/
 /* Configuration path in environment
@@ -40,6 +41,16 @@
  */
 #define CONFIG_DEFAULT_RESOLUTION       300
 
+/* Preview resolution, DPI. In preview mode, image is scanned at
+ * the minimal resolution, supported by device, and then downscaled,
+ * but not below this resolution
+ */
+#define CONFIG_PREVIEW_RESOLUTION       75
+
+/* Max number of simultaneously pending ADF page requests
+ */
+#define CONFIG_ADF_PREFETCH_MAX         8
+
 /******************** Forward declarations ********************/
 /* Type device represents a scanner devise
  */
@@ -103,9 +114,23 @@ typedef struct {
     conf_device *devices;         /* Manually configured devices */
     bool        discovery;        /* Scanners discovery enabled */
     bool        model_is_netname; /* Use network name instead of model */
+    bool        prefer_png;       /* Prefer PNG format, if supported */
+    size_t      decode_ahead;     /* Decode-ahead memory budget, bytes */
+    size_t      spool_memory;     /* In-memory pages budget, bytes */
+    const char  *spool_dir;       /* Spool directory, NULL for default */
+    int         adf_prefetch;     /* Max. pending ADF page requests */
+    bool        http_native;      /* Use native HTTP client */
+    bool        caps_cache;       /* Cache device capabilities on disk */
+    const char  *cache_dir;       /* Cache directory, NULL for default */
+    bool        caps_lazy;        /* Fetch capabilities on device open */
+    int         list_timeout;     /* Max. wait for device list, ms */
+    int         device_timeout;   /* Max. wait for single device, ms */
 } conf_data;
 
-#define CONF_INIT { false, NULL, NULL, true, true }
+#define CONF_INIT {                                             \
+        false, NULL, NULL, true, true, false, 0, 0, NULL, 1,    \
+        false, true, NULL, false, 5000, 3000                    \
+    }
 
 extern conf_data conf;
 
@@ -228,6 +253,13 @@ eloop_new_avahi_poll (void);
 void
 eloop_call (GSourceFunc func, gpointer data);
 
+/* Call function on a context of event loop thread. The destroy
+ * callback, if not NULL, is called after func, or instead of it,
+ * if event loop is destroyed before func has a chance to run
+ */
+void
+eloop_call_full (GSourceFunc func, gpointer data, GDestroyNotify destroy);
+
 /* Event notifier. Calls user-defined function on a context
  * of event loop thread, when event is triggered. This is
  * safe to trigger the event from a context of any thread
@@ -268,6 +300,40 @@ eloop_timer_new (int timeout, void (*callback)(void *), void *data);
 void
 eloop_timer_cancel (eloop_timer *timer);
 
+/* Mask of file descriptor events
+ */
+typedef enum {
+    ELOOP_FDPOLL_READ  = (1 << 0),
+    ELOOP_FDPOLL_WRITE = (1 << 1),
+    ELOOP_FDPOLL_BOTH  = ELOOP_FDPOLL_READ | ELOOP_FDPOLL_WRITE
+} ELOOP_FDPOLL_MASK;
+
+/* File descriptor poller. Calls user-defined function on a
+ * context of event loop thread, when file descriptor becomes
+ * readable or writable, according to the event mask. Errors
+ * and hangups are reported as all requested events
+ */
+typedef struct eloop_fdpoll eloop_fdpoll;
+
+/* Create new file descriptor poller. Initial mask is empty
+ */
+eloop_fdpoll*
+eloop_fdpoll_new (int fd,
+        void (*callback)(int fd, void *data, ELOOP_FDPOLL_MASK mask),
+        void *data);
+
+/* Destroy file descriptor poller. It is safe to call this
+ * function from the poller's callback. File descriptor is
+ * not closed
+ */
+void
+eloop_fdpoll_free (eloop_fdpoll *fdpoll);
+
+/* Set event mask. Returns previous mask
+ */
+ELOOP_FDPOLL_MASK
+eloop_fdpoll_set_mask (eloop_fdpoll *fdpoll, ELOOP_FDPOLL_MASK mask);
+
 /* Format error string, as printf() does and save result
  * in the memory, owned by the event loop
  *
@@ -344,6 +410,10 @@ http_data_unref (http_data *data);
  */
 typedef struct http_client http_client;
 
+/* Type http_query represents HTTP query (both request and response)
+ */
+typedef struct http_query http_query;
+
 /* Create new http_client
  */
 http_client*
@@ -354,22 +424,35 @@ http_client_new (device *dev);
 void
 http_client_free (http_client *client);
 
-/* Cancel pending http_query, if any
+/* Cancel all pending queries, if any
  */
 void
 http_client_cancel (http_client *client);
 
+/* Check if client has pending queries
+ */
+bool
+http_client_has_pending (const http_client *client);
+
 /* Set on-error callback. If this callback is not NULL,
  * in a case of transport error it will be called instead
  * of the http_query callback
+ *
+ * The failed query is passed to the callback. It is owned
+ * by the http_client and released when callback returns,
+ * so callback must forget all references to it and must
+ * not cancel it
  */
 void
 http_client_onerror (http_client *client,
-        void (*callback)(device *dev, error err));
+        void (*callback)(device *dev, http_query *q, error err));
 
-/* Type http_query represents HTTP query (both request and response)
+/* Enable or disable persistent connections. If disabled, server is
+ * asked to close connection after each query. Persistent connections
+ * are enabled by default
  */
-typedef struct http_query http_query;
+void
+http_client_keepalive (http_client *client, bool enable);
 
 /* Create new http_query
  *
@@ -378,12 +461,64 @@ typedef struct http_query http_query;
  *
  * When query is finished, callback will be called. After return from
  * callback, memory, owned by http_query will be invalidated
+ *
+ * Multiple queries may be pending on the same http_client at the
+ * same time. They are executed concurrently, and each of them can
+ * be cancelled individually
  */
 http_query*
 http_query_new (http_client *client, http_uri *uri, const char *method,
         char *body, const char *content_type,
         void (*callback) (device *dev, http_query *q));
 
+/* Cancel unfinished http_query. Callback will not be called and
+ * memory owned by the http_query will be released. Other queries
+ * of the same http_client are not affected
+ */
+void
+http_query_cancel (http_query *q);
+
+/* Set on-rx-data callback. If this callback is not NULL,
+ * response body is received incrementally, and callback is
+ * called every time when the next portion of data arrives.
+ *
+ * Data received so far is available via
+ * http_query_get_response_data(). Note, the returned http_data
+ * may grow after return from callback, and its bytes pointer
+ * may change, so don't cache it across callbacks
+ *
+ * The http_query completion callback is still called, when
+ * the query is finished
+ */
+void
+http_query_onrxdata (http_query *q, void (*callback)(device *dev, http_query *q));
+
+/* Allow to preallocate up to max bytes for the response data, if its
+ * size is announced by server. By default nothing is preallocated,
+ * so bogus Content-Length cannot make us to waste memory. Use it
+ * only for queries with large and predictable responses
+ */
+void
+http_query_rxprealloc (http_query *q, size_t max);
+
+/* Set lock, held while response data is being modified, including
+ * the on-rx-data callback invocation. It allows response data to
+ * be accessed from another thread while it is being received
+ */
+void
+http_query_rxlock (http_query *q, GRecMutex *lock);
+
+/* Set on-rx-headers callback. If this callback is not NULL,
+ * it is called when response headers are received, before
+ * the response body. At this point, http_query_status() and
+ * http_query_get_response_header() may be used
+ *
+ * If query is restarted (i.e., redirected), callback is
+ * called for each received response
+ */
+void
+http_query_onrxhdr (http_query *q, void (*callback)(device *dev, http_query *q));
+
 /* Get query error, if any
  *
  * Both transport errors and erroneous HTTP response codes
@@ -692,6 +827,7 @@ enum {
     OPT_SCAN_RESOLUTION,
     OPT_SCAN_COLORMODE,         /* I.e. color/grayscale etc */
     OPT_SCAN_SOURCE,            /* Platem/ADF/ADF Duplex */
+    OPT_PREVIEW,                /* Preview mode */
 
     /* Geometry options group */
     OPT_GROUP_GEOMETRY,
@@ -837,9 +973,18 @@ typedef struct {
     OPT_SOURCE             src;               /* Current source */
     OPT_COLORMODE          colormode;         /* Color mode */
     SANE_Word              resolution;        /* Current resolution */
+    SANE_Word              *resolutions;      /* Discrete resolutions,
+                                                 including downscaled */
+    SANE_Range             res_range;         /* Resolutions range,
+                                                 including downscaled */
+    bool                   preview;           /* Preview mode */
     SANE_Fixed             tl_x, tl_y;        /* Top-left x/y */
     SANE_Fixed             br_x, br_y;        /* Bottom-right x/y */
     SANE_Parameters        params;            /* Scan parameters */
+    SANE_Word              scan_resolution;   /* Resolution, requested
+                                                 from device */
+    int                    scale;             /* Image downscaling factor,
+                                                 1, 2, 4 or 8 */
 } devopt;
 
 /* Initialize device options
@@ -867,6 +1012,19 @@ devopt_set_option (devopt *opt, SANE_Int option, void *value, SANE_Word *info);
 SANE_Status
 devopt_get_option (devopt *opt, SANE_Int option, void *value);
 
+/******************** Capabilities cache ********************/
+/* Load ScannerCapabilities of the device from the cache. Key
+ * identifies the device (device UUID or URI). Returns NULL, if
+ * not cached. Returned data must be released with g_free()
+ */
+char*
+capscache_load (const char *key, size_t *size);
+
+/* Save ScannerCapabilities of the device into the cache
+ */
+void
+capscache_save (const char *key, const char *data, size_t size);
+
 /******************** ZeroConf (device discovery) ********************/
 /* ZeroConf resolved address information
  */
@@ -875,6 +1033,9 @@ struct zeroconf_addrinfo {
     const char        *uri;      /* I.e, "http://192.168.1.1:8080/eSCL/" */
     bool              ipv6;      /* This is an IPv6 address */
     bool              linklocal; /* This is a link-local address */
+    const char        *uuid;     /* Device UUID from TXT, may be NULL */
+    const char        *vendor;   /* Vendor from TXT, may be NULL */
+    const char        *model;    /* Model from TXT, may be NULL */
     zeroconf_addrinfo *next;     /* Next address in the list */
 };
 
@@ -1013,18 +1174,31 @@ typedef struct {
     int wid, hei;      /* Image width and height */
 } image_window;
 
+/* This error is returned by image decoder, when it cannot proceed
+ * until more input data will be available. This is not a fatal
+ * error: decoding may continue after image_decoder_update() call
+ */
+extern const char image_decoder_eagain[];
+
+#define IMAGE_DECODER_EAGAIN    ERROR(image_decoder_eagain)
+
 /* Image decoder, with virtual methods
  */
 typedef struct image_decoder image_decoder;
 struct image_decoder {
     const char *content_type;
     void  (*free) (image_decoder *decoder);
-    error (*begin) (image_decoder *decoder, const void *data, size_t size);
+    error (*begin) (image_decoder *decoder, const void *data, size_t size,
+                    bool more);
+    error (*update) (image_decoder *decoder, const void *data, size_t size,
+                    bool more);
     void  (*reset) (image_decoder *decoder);
+    void  (*set_scale) (image_decoder *decoder, int scale);
     int   (*get_bytes_per_pixel) (image_decoder *decoder);
     void  (*get_params) (image_decoder *decoder, SANE_Parameters *params);
     error (*set_window) (image_decoder *decoder, image_window *win);
-    error (*read_line) (image_decoder *decoder, void *buffer);
+    error (*read_lines) (image_decoder *decoder, void *buffer,
+                         size_t stride, int count, int *n_read);
 };
 
 /* Create JPEG image decoder
@@ -1032,6 +1206,16 @@ struct image_decoder {
 image_decoder*
 image_decoder_jpeg_new (void);
 
+/* Create PNG image decoder
+ */
+image_decoder*
+image_decoder_png_new (void);
+
+/* Create PNM image decoder
+ */
+image_decoder*
+image_decoder_pnm_new (void);
+
 /* Free image decoder
  */
 static inline void
@@ -1049,12 +1233,33 @@ image_content_type (image_decoder *decoder)
 }
 
 /* Begin image decoding. Decoder may assume that provided data
- * buffer remains valid during a whole decoding cycle
+ * buffer remains valid during a whole decoding cycle, or until
+ * image_decoder_update() is called
+ *
+ * If `more' is true, image is not completely received yet, and
+ * more data will be provided later with image_decoder_update().
+ * At this case, IMAGE_DECODER_EAGAIN is returned, if available
+ * data is not enough to parse the image header
  */
 static inline error
-image_decoder_begin (image_decoder *decoder, const void *data, size_t size)
+image_decoder_begin (image_decoder *decoder, const void *data, size_t size,
+        bool more)
 {
-    return decoder->begin(decoder, data, size);
+    return decoder->begin(decoder, data, size, more);
+}
+
+/* Update image data. Called when more data is received. The data
+ * pointer may differ from the previously provided, but bytes
+ * already seen by decoder must remain the same
+ *
+ * If image header was not parsed yet, decoder retries, and returns
+ * the same result, as image_decoder_begin() would return
+ */
+static inline error
+image_decoder_update (image_decoder *decoder, const void *data, size_t size,
+        bool more)
+{
+    return decoder->update(decoder, data, size, more);
 }
 
 /* Reset image decoder after use. After reset, decoding of the
@@ -1066,6 +1271,20 @@ image_decoder_reset (image_decoder *decoder)
     decoder->reset(decoder);
 }
 
+/* Set image downscaling factor, which may be 1, 2, 4 or 8. Image
+ * width and height are divided by this factor, rounding up
+ *
+ * Scale must be set before image_decoder_begin() and remains in
+ * effect for all subsequent images. Image parameters, returned by
+ * image_decoder_get_params(), and clipping window are in pixels of
+ * downscaled image
+ */
+static inline void
+image_decoder_set_scale (image_decoder *decoder, int scale)
+{
+    decoder->set_scale(decoder, scale);
+}
+
 /* Get bytes count per pixel
  */
 static inline int
@@ -1075,7 +1294,8 @@ image_decoder_get_bytes_per_pixel (image_decoder *decoder)
 }
 
 /* Get image parameters. Can be called at any time between
- * image_decoder_begin() and image_decoder_reset()
+ * successful image_decoder_begin() (or image_decoder_update(),
+ * if begin returned IMAGE_DECODER_EAGAIN) and image_decoder_reset()
  *
  * Decoder must return an actual image parameters, regardless
  * of clipping window set by image_decoder_set_window()
@@ -1103,15 +1323,75 @@ image_decoder_set_window (image_decoder *decoder, image_window *win)
     return decoder->set_window(decoder, win);
 }
 
+/* Read strip of up to `count' next lines of image. Lines are stored
+ * into the buffer, `stride' bytes apart. Decoder may safely assume
+ * the provided buffer is big enough to keep `count' entire lines
+ *
+ * Number of actually decoded lines is returned via `n_read'. It
+ * may be less that requested, but error is returned only if
+ * no lines were decoded at all
+ *
+ * If image is not completely received yet, IMAGE_DECODER_EAGAIN
+ * may be returned. At this case, nothing is written to the buffer
+ * and read may be retried after image_decoder_update()
+ */
+static inline error
+image_decoder_read_lines (image_decoder *decoder, void *buffer,
+        size_t stride, int count, int *n_read)
+{
+    return decoder->read_lines(decoder, buffer, stride, count, n_read);
+}
+
 /* Read next line of image. Decoder may safely assume the provided
  * buffer is big enough to keep the entire line
  */
 static inline error
 image_decoder_read_line (image_decoder *decoder, void *buffer)
 {
-    return decoder->read_line(decoder, buffer);
+    int n_read;
+    return decoder->read_lines(decoder, buffer, 0, 1, &n_read);
 }
 
+/******************** Image conversion ********************/
+/* Copy `count' pixels of `bpp' bytes each from the source line into
+ * the destination line, downscaling line by the `scale' factor.
+ * Copying starts from the pixel `x_off' of downscaled line
+ */
+static inline void
+image_copy_pixels (uint8_t *dst, const uint8_t *src, int bpp,
+        int x_off, int count, int scale)
+{
+    size_t step = (size_t) scale * bpp;
+    int    i;
+
+    src += (size_t) x_off * step;
+
+    if (scale == 1) {
+        memcpy(dst, src, (size_t) count * bpp);
+        return;
+    }
+
+    for (i = 0; i < count; i ++) {
+        memcpy(dst, src, bpp);
+        dst += bpp;
+        src += step;
+    }
+}
+
+/* Initialize lineart conversion
+ */
+void
+image_lineart_init (void);
+
+/* Pack line of 8-bit grayscale pixels into 1-bit lineart, 8 pixels
+ * per byte, most significant bit first. As required by SANE, black
+ * pixels are encoded as 1
+ *
+ * dst may be the same as src, so conversion may be done in place
+ */
+void
+image_lineart_pack (uint8_t *dst, const uint8_t *src, size_t pixels);
+
 /******************** Mathematical Functions ********************/
 /* Find greatest common divisor of two positive integers
  */